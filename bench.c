@@ -0,0 +1,212 @@
+// Benchmark harness for the hot paths of rmg.c. Built and run by
+// `make bench`, prints one JSON document to stdout. Everything rmg.c
+// itself prints goes to /dev/null.
+#define main rmg_main
+#include "rmg.c"
+#undef main
+
+#include <sys/resource.h>
+
+#define BENCH_SEED 1
+#define BENCH_MIN_ROOMS 4
+#define BENCH_MAX_ROOMS 1048576
+#define BENCH_WALKS 64
+
+typedef struct Samples {
+    double* values;
+    int count;
+    int capacity;
+} Samples;
+
+typedef struct Bench {
+    FILE* out;
+    int first;
+    Samples samples;
+    struct timespec start;
+} Bench;
+
+void start_sample(Bench* bench) {
+    clock_gettime(CLOCK_MONOTONIC, &bench->start);
+}
+
+void end_sample(Bench* bench) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    Samples* samples = &bench->samples;
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? 2 * samples->capacity : 64;
+        samples->values = realloc(samples->values, samples->capacity * sizeof(double));
+        if (samples->values==NULL) ERR("realloc");
+    }
+    samples->values[samples->count++] = ELAPSED(bench->start, end);
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+long process_peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) ERR("getrusage");
+    return usage.ru_maxrss;
+}
+
+// Writes one result object and forgets the samples. process_peak_rss_kb is
+// the peak of the whole process so far, not of this operation alone.
+void report(Bench* bench, char* operation, int rooms) {
+    Samples* samples = &bench->samples;
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+    double median = samples->values[samples->count / 2];
+    int p99_index = (int) ceil(0.99 * samples->count) - 1;
+    double p99 = samples->values[p99_index < 0 ? 0 : p99_index];
+
+    fprintf(bench->out, "%s\n    {\"operation\": \"%s\", \"rooms\": %d, \"runs\": %d, "
+        "\"median_ms\": %.4f, \"p99_ms\": %.4f, \"rooms_per_second\": %.0f, \"process_peak_rss_kb\": %ld}",
+        bench->first ? "" : ",", operation, rooms, samples->count,
+        median * 1000, p99 * 1000, median > 0 ? rooms / median : 0, process_peak_rss_kb());
+    fflush(bench->out);
+    bench->first = 0;
+    samples->count = 0;
+}
+
+void clear_items(Graph* map) {
+    for (int i = 0; i < map->vertex_count; i++) {
+        for (int k = 0; k < 2; k++) {
+            map->vertices[i].items[k] = (Item) { .id = -1, .dest_vertex_id = -1 };
+            map->vertices[i].assigned_item_ids[k] = -1;
+        }
+    }
+}
+
+void bench_rooms(Bench* bench, int rooms, Rng* rng) {
+    int runs = 2000000 / rooms;
+    if (runs > 101) runs = 101;
+    if (runs < 3) runs = 3;
+
+    char text_path[64];
+    char binary_path[64];
+    char save_path[64];
+    snprintf(text_path, sizeof(text_path), "/tmp/rmg-bench-%d.map", getpid());
+    snprintf(binary_path, sizeof(binary_path), "/tmp/rmg-bench-%d%s", getpid(), BINARY_MAP_EXTENSION);
+    snprintf(save_path, sizeof(save_path), "/tmp/rmg-bench-%d.save", getpid());
+
+    Graph* map = NULL;
+    for (int i = 0; i < runs; i++) {
+        if (map) free_graph(map);
+        start_sample(bench);
+        map = generate_random_graph(rooms, rng);
+        end_sample(bench);
+    }
+    report(bench, "generate_random_graph", rooms);
+
+    for (int i = 0; i < runs; i++) {
+        start_sample(bench);
+        BFS(map, 0);
+        end_sample(bench);
+    }
+    report(bench, "BFS", rooms);
+
+    Game* game = new_game(map, rng_next(rng));
+    for (int i = 0; i < runs; i++) {
+        clear_items(map);
+        start_sample(bench);
+        spawn_items(game);
+        end_sample(bench);
+    }
+    report(bench, "spawn_items", rooms);
+    free_item_index(game);
+    build_item_index(game);
+
+    for (int i = 0; i < runs; i++) {
+        start_sample(bench);
+        save_game(game, save_path);
+        end_sample(bench);
+    }
+    report(bench, "save_game", rooms);
+
+    for (int i = 0; i < runs; i++) {
+        int sequence;
+        start_sample(bench);
+        Game* loaded = load_game(save_path, &sequence, MAX_LARGE_VERTEX_COUNT);
+        end_sample(bench);
+        if (loaded == NULL) ERR("load_game");
+        free_game(loaded);
+    }
+    report(bench, "load_game", rooms);
+
+    save_graph_to_file(map, text_path);
+    save_graph_to_file(map, binary_path);
+    for (int i = 0; i < runs; i++) {
+        start_sample(bench);
+        Graph* read = read_graph_from_path(text_path, MAX_LARGE_VERTEX_COUNT);
+        end_sample(bench);
+        if (read == NULL) ERR("read_graph_from_path");
+        free_graph(read);
+    }
+    report(bench, "read_graph_from_path (text)", rooms);
+
+    for (int i = 0; i < runs; i++) {
+        start_sample(bench);
+        Graph* read = read_graph_from_path(binary_path, MAX_LARGE_VERTEX_COUNT);
+        end_sample(bench);
+        if (read == NULL) ERR("read_graph_from_path");
+        free_graph(read);
+    }
+    report(bench, "read_graph_from_path (binary)", rooms);
+
+    PathfinderPool* pool = create_pathfinder_pool(game, rng_next(rng));
+    Frame frame;
+    frame.length = 0;
+    for (int i = 0; i < runs; i++) {
+        int room_id = rng_below(rng, rooms);
+        start_sample(bench);
+        find_moderately_short_path(&frame, pool, BENCH_WALKS, room_id);
+        end_sample(bench);
+        frame.length = 0;
+    }
+    report(bench, "find_moderately_short_path", rooms);
+    free_pathfinder_pool(pool);
+
+    unlink(text_path);
+    unlink(binary_path);
+    unlink(save_path);
+    free_game(game);
+}
+
+int main(int argc, char** argv) {
+    int max_rooms = BENCH_MAX_ROOMS;
+    if (argc > 2) {
+        fprintf(stderr, "[!] USAGE: %s [max-rooms]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc == 2) max_rooms = atoi(argv[1]);
+    if (max_rooms < BENCH_MIN_ROOMS || max_rooms > MAX_LARGE_VERTEX_COUNT) {
+        fprintf(stderr, "[!] Choose between %d and %d rooms.\n", BENCH_MIN_ROOMS, MAX_LARGE_VERTEX_COUNT);
+        exit(EXIT_FAILURE);
+    }
+
+    Bench bench;
+    bench.first = 1;
+    bench.samples = (Samples) { NULL, 0, 0 };
+    int out_fd = dup(STDOUT_FILENO);
+    if (out_fd < 0) ERR("dup");
+    if ((bench.out = fdopen(out_fd, "w")) == NULL) ERR("fdopen");
+    if (freopen("/dev/null", "w", stdout) == NULL) ERR("freopen");
+
+    Rng rng;
+    seed_rng(&rng, BENCH_SEED);
+
+    fprintf(bench.out, "{\n  \"seed\": %d,\n  \"threads\": %ld,\n  \"results\": [",
+        BENCH_SEED, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int rooms = BENCH_MIN_ROOMS; rooms <= max_rooms; rooms *= 4) {
+        fprintf(stderr, "[*] Benchmarking %d rooms ...\n", rooms);
+        bench_rooms(&bench, rooms, &rng);
+        if (rooms < max_rooms && rooms * 4 > max_rooms) rooms = max_rooms / 4;
+    }
+    fprintf(bench.out, "\n  ]\n}\n");
+    fclose(bench.out);
+    free(bench.samples.values);
+    return EXIT_SUCCESS;
+}
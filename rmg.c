@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -11,15 +11,45 @@
 #include <math.h>
 #include <ftw.h>
 #include <dirent.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #define MAX_INPUT_LENGTH 256
-#define MAX_QUEUE_SIZE 256
-#define MAX_PATHFINDING_THREADS 100
+#define INPUT_BUFFER_SIZE 4096
 #define MAX_FD 20
 #define MIN_VERTEX_COUNT 4
 #define MAX_VERTEX_COUNT 512
-
-#define ELAPSED(start,end) ((end).tv_sec-(start).tv_sec)+(((end).tv_nsec - (start).tv_nsec) * 1.0e-9)
+#define MAX_LARGE_VERTEX_COUNT 16777216
+#define NARROW_FIELD_WIDTH 4
+#define WIDE_FIELD_WIDTH 8
+#define BINARY_MAP_MAGIC "RMGB"
+#define BINARY_MAP_VERSION 1
+#define BINARY_MAP_EXTENSION ".rmgb"
+#define WRITE_BUFFER_SIZE (64*1024)
+#define JOURNAL_SEQUENCE_LIMIT 9999
+#define AUTOSAVE_INTERVAL 60
+#define AUTOSAVE_DEBOUNCE 5
+#define ROUTE_TABLE_MAX_VERTICES 2048
+#define MAX_WALK_LENGTH 1000
+#define PLAN_NEIGHBOURS 8
+#define ITEM_IN_INVENTORY (-2)
+#define MAX_COMMAND_KINDS 32
+#define HISTOGRAM_BUCKETS 48
+#define STAT_COMMANDS 5
+#define SIGNAL_BATCH 64
+#define EPOLL_EVENTS 8
+#define EDGE_BITSET_MAX_VERTICES 4096
+#define EDGE_HASH_EMPTY 0xFFFFFFFFFFFFFFFFULL
+
+#define ELAPSED(start,end) (((end).tv_sec-(start).tv_sec)+(((end).tv_nsec - (start).tv_nsec) * 1.0e-9))
 #define ERR(source) (perror(source),\
                      fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      exit(EXIT_FAILURE))
@@ -33,14 +63,13 @@ typedef struct Item {
     int dest_vertex_id;
 } Item;
 
-typedef struct AdjVertexNode {
-    int id;
-    struct AdjVertexNode* next;
-} AdjVertexNode;
+typedef struct Edge {
+    int from;
+    int to;
+} Edge;
 
 typedef struct Vertex {
     int id;
-    AdjVertexNode* head;
     Item items[2];
     int assigned_item_ids[2];
 } Vertex;
@@ -50,68 +79,706 @@ typedef struct Player {
     Item items[2];
 } Player;
 
+// xoshiro256** state. Every thread that needs random numbers owns one, so
+// runs are reproducible from the seed given with -s.
+typedef struct Rng {
+    uint64_t state[4];
+} Rng;
+
+// Growable ring buffer, capacity is always a power of two.
 typedef struct Queue {
-    int items[MAX_QUEUE_SIZE];
+    int* items;
+    int capacity;
     int front;
-    int rear;
+    int count;
 } Queue;
 
+// Text files store every number right-aligned in a fixed-width field.
+// Maps whose item ids do not fit in NARROW_FIELD_WIDTH characters are
+// written with WIDE_FIELD_WIDTH fields and the "VRTW"/"PLYW" tags.
+// The buffer is flushed to fd whenever the next field would not fit.
+// overflow is set once a number was too wide for its field.
+typedef struct TextBuffer {
+    int fd;
+    int field_width;
+    int overflow;
+    size_t length;
+    size_t bytes_written;
+    char data[WRITE_BUFFER_SIZE];
+} TextBuffer;
+
+// Screen output of one command. It reaches stdout in a single write unless
+// it outgrows the buffer, as a full map dump does.
+typedef struct Frame {
+    size_t length;
+    char data[WRITE_BUFFER_SIZE];
+} Frame;
+
+// Reads a whole text file from a private mapping. Errors are sticky: after
+// the first one every parse function is a no-op, so callers only check
+// failed once per record.
+typedef struct TextParser {
+    char* path;
+    char* data;
+    size_t size;
+    size_t pos;
+    int line;
+    size_t line_start;
+    int field_width;
+    int failed;
+} TextParser;
+
+// Membership index of undirected edges, keyed by the (min, max) room pair.
+// Small maps use a packed vertex_count x vertex_count bit matrix, large ones
+// an open-addressing hash set with linear probing.
+typedef struct EdgeIndex {
+    unsigned long long* bits;
+    unsigned long long* keys;
+    size_t capacity;
+    size_t count;
+} EdgeIndex;
+
+typedef struct UnionFind {
+    int* parent;
+    int* rank;
+    int count;
+} UnionFind;
+
+// Adjacency is kept in compressed sparse row form: the neighbours of room v
+// are neighbors[offsets[v]] .. neighbors[offsets[v+1]-1], sorted ascending.
+// Edges added with add_edge() are collected in pending_edges and merged into
+// the CSR arrays by finalize_graph(). For maps read from a binary file the
+// CSR arrays point into the file mapping instead of the heap, and the edge
+// index stays empty: such maps get no new edges, so are_connected() looks
+// the edge up in the sorted list instead.
 typedef struct Graph {
     int vertex_count;
     Vertex* vertices;
+    int* offsets;
+    int* neighbors;
+    void* mapping;
+    size_t mapping_size;
+    Edge* pending_edges;
+    int pending_count;
+    int pending_capacity;
+    EdgeIndex edge_index;
+    unsigned long topology_version;
 } Graph;
 
+// All-pairs shortest paths: distance[from * vertex_count + to] and the
+// first room to move to on the way, next_hop[from * vertex_count + to].
+// Only valid while topology_version matches the graph it was built for.
+typedef struct RouteTable {
+    int vertex_count;
+    int* distance;
+    int* next_hop;
+    unsigned long topology_version;
+} RouteTable;
+
+typedef struct thread_routes {
+    pthread_t thread_id;
+    Graph* graph;
+    RouteTable* table;
+    int* next_source;
+} thread_routes;
+
+// Append-only log of the state changes made since the snapshot with the
+// same sequence number. Each record is one line: a tag and fixed-width
+// fields. rotate_journal() moves the current log to prev_path and starts
+// an empty one for the next snapshot. unsynced is set while records
+// written since the last sync_journal() may not be on disk yet.
+typedef struct Journal {
+    int fd;
+    int unsynced;
+    char* path;
+    char* prev_path;
+    int sequence;
+    TextBuffer* buffer;
+} Journal;
+
+// Every state change bumps dirty_generation. Once the state is dirty the
+// event loop arms its timer for the moment interval seconds have passed
+// since the last autosave and debounce seconds since the last change, but
+// no later than interval + debounce seconds after the last autosave.
+typedef struct AutosaveSchedule {
+    unsigned long dirty_generation;
+    unsigned long saved_generation;
+    struct timespec last_saved;
+    struct timespec last_change;
+    int interval;
+    int debounce;
+} AutosaveSchedule;
+
+// Where each item id is: a room and slot, or an inventory slot with room
+// set to ITEM_IN_INVENTORY. delivered counts the items lying in their
+// destination room, in_rooms and in_inventory the items present. Every
+// function that moves an item keeps them up to date.
+typedef struct ItemIndex {
+    int item_count;
+    int* room;
+    int* slot;
+    int delivered;
+    int in_rooms;
+    int in_inventory;
+} ItemIndex;
+
+// Rooms holding at least one item, in no particular order;
+// position[room] is the room's index in rooms or -1.
+typedef struct RoomSet {
+    int* rooms;
+    int* position;
+    int count;
+} RoomSet;
+
+// Bucket i counts durations of [2^i, 2^(i+1)) nanoseconds.
+typedef struct Histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} Histogram;
+
+// Measurements of a running game. Every field is updated with atomic
+// operations, so recording never takes a lock.
+typedef struct Stats {
+    Histogram commands[STAT_COMMANDS];
+    Histogram autosave;
+    uint64_t autosave_bytes;
+    uint64_t swaps;
+    uint64_t swap_batches;
+    uint64_t peak_swaps_per_second;
+    uint64_t started_ns;
+} Stats;
+
+// A running game is only touched by the event loop of start_game(). Worker
+// threads get the map topology, which never changes, or copies.
 typedef struct Game {
     Graph* map;
+    RouteTable* routes;
     Player* player;
-    struct timespec last_saved;
+    Journal* journal;
+    AutosaveSchedule* schedule;
+    Rng rng;
+    ItemIndex items;
+    RoomSet occupied;
+    Stats* stats;
 } Game;
 
-typedef struct msp_node {
-    int room_id;
-    struct msp_node* next;
-} msp_node;
-
-typedef struct thread_pathfinder {
+// Binary map file: this header, then int32_t offsets[vertex_count + 1] and
+// int32_t neighbors[neighbor_count] in host byte order, laid out exactly
+// like the CSR arrays of Graph.
+typedef struct BinaryMapHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t vertex_count;
+    uint32_t neighbor_count;
+} BinaryMapHeader;
+
+// Copy of the mutable part of a Game. The map topology and the item
+// assignments never change once a game has started, so they are shared.
+typedef struct GameSnapshot {
+    Graph* map;
+    Player player;
+    Item (*items)[2];
+    int sequence;
+} GameSnapshot;
+
+// An autosave written by its own thread. The snapshot was taken and the
+// journal rotated on the event loop; the thread runs finish_compaction()
+// and writes 1 to done_fd. generation is the dirty generation the
+// snapshot holds.
+typedef struct AutosaveWriter {
     pthread_t thread_id;
+    Journal* journal;
+    GameSnapshot* snapshot;
+    char* path;
+    unsigned long generation;
+    uint64_t start_ns;
+    int done_fd;
+    int err;
+    off_t bytes;
+} AutosaveWriter;
+
+// Workers live as long as the game. A find-path request puts walks_queued
+// walks from start_room to room_id on the queue; every finished walk is
+// compared against best and counted in walks_done. Walk k of query q is
+// seeded from (seed, q, k) so the result does not depend on which worker
+// ran it. best_length is also read without the lock by running walks,
+// which give up once they are longer than it. With exact_queued set, one
+// worker also computes the shortest path into exact_path. done_fd is an
+// eventfd written to once the last walk and the exact search are done;
+// walks_end_ns is when the last walk finished.
+typedef struct PathfinderPool {
+    pthread_t* threads;
+    int threads_count;
+    pthread_mutex_t mxPool;
+    pthread_cond_t cvQueued;
+    pthread_cond_t cvDone;
     Game* game_state;
+    int start_room;
     int room_id;
-    int seed;
-} thread_pathfinder;
-
-typedef struct thread_autosave {
-    pthread_t thread_id;
-    Game* game_state;
-    pthread_mutex_t* pmxGameState;
-    char* path;
-} thread_autosave;
-
-typedef struct thread_signal {
+    int walks_queued;
+    int walks_total;
+    int walks_done;
+    int* best_path;
+    int best_length;
+    int best_walk;
+    uint64_t walks_end_ns;
+    int exact_queued;
+    int exact_done;
+    int* exact_path;
+    int exact_length;
+    int exact_rebuilt;
+    uint64_t exact_ns;
+    uint64_t seed;
+    uint64_t query;
+    int done_fd;
+    int stop;
+} PathfinderPool;
+
+// Item positions as seen by the delivery planner. Every room has two
+// slots, room_items[2 * room + slot], -1 marking a free one; item_room is
+// -1 for carried items. pending lists items put down short of their
+// destination, which have to be fetched again.
+typedef struct PlanState {
+    int location;
+    int carried[2];
+    int* room_items;
+    int* item_room;
+    int* pending;
+    int pending_count;
+} PlanState;
+
+// A copy of the game taken before the solver threads start. order lists the
+// items that still have to be delivered, in the order the solver threads
+// start from. nearby[PLAN_NEIGHBOURS * room] lists the items waiting
+// closest to each room. Every solver thread writes 1 to done_fd once it
+// stops, so the event loop knows when all threads_count of them are done.
+typedef struct DeliveryPlanner {
+    RouteTable* routes;
+    int vertex_count;
+    int item_count;
+    int* item_dest;
+    PlanState initial;
+    int* order;
+    int order_count;
+    int* nearby;
+    int lower_bound;
+    int done_fd;
+    struct thread_planner* threads;
+    int threads_count;
+    struct timespec start;
+} DeliveryPlanner;
+
+typedef struct thread_planner {
     pthread_t thread_id;
-    Game* game_state;
-    pthread_mutex_t* pmxGameState;
-} thread_signal;
+    DeliveryPlanner* planner;
+    Rng rng;
+    struct timespec deadline;
+    int* order;
+    int moves;
+    long evaluations;
+} thread_planner;
+
+typedef struct CommandTiming {
+    char name[MAX_INPUT_LENGTH];
+    int count;
+    double total;
+    double max;
+} CommandTiming;
+
+// State of a headless session run with -x: timings per command name and
+// the checksum of the last game that was quit.
+typedef struct Script {
+    int kinds;
+    CommandTiming commands[MAX_COMMAND_KINDS];
+    uint64_t checksum;
+    int has_checksum;
+} Script;
+
+typedef struct Options {
+    char* backup_path;
+    int max_vertex_count;
+    int autosave_interval;
+    int autosave_debounce;
+    int route_table_max_vertices;
+    uint64_t seed;
+    int seed_given;
+    char* script_path;
+    Script* script;
+} Options;
+
+// Lines read from fd. The event loop only reads once epoll reports fd
+// readable, so a read never blocks it. Longer lines than
+// MAX_INPUT_LENGTH - 1 are cut, and the rest of a line that did not fit
+// in the buffer is discarded up to its newline.
+typedef struct LineReader {
+    int fd;
+    int length;
+    int eof;
+    int discarding;
+    char data[INPUT_BUFFER_SIZE];
+} LineReader;
+
+// Everything a running game waits for, multiplexed by one epoll instance:
+// commands on input, SIGUSR1 and SIGUSR2 on signal_fd, the autosave
+// deadline on timer_fd, finished walks on the done_fd of pathfinders and
+// finished solver threads of a plan-deliveries on plan_fd and a written
+// autosave on save_fd. input_polled is
+// unset when input cannot be polled, like a regular file, which is then
+// read whenever the loop wants a command. Input is not watched while a
+// find-path is searching or a planner is running, so commands keep their
+// order.
+typedef struct EventLoop {
+    Game* game;
+    Options* options;
+    Frame* frame;
+    LineReader* input;
+    int input_polled;
+    int epoll_fd;
+    int signal_fd;
+    int timer_fd;
+    PathfinderPool* pathfinders;
+    unsigned long armed_generation;
+    uint64_t window_start;
+    uint64_t window_swaps;
+    int searching;
+    int search_room;
+    struct timespec search_start;
+    int plan_fd;
+    DeliveryPlanner* planner;
+    int plan_threads_left;
+    int save_fd;
+    AutosaveWriter* writer;
+    struct timespec command_start;
+} EventLoop;
 
 // 
 // BUFFER MANIPULATION FUNCTIONS
 // 
 
-void int_to_buffer(char* buffer, int i) {
-    sprintf(&buffer[strlen(buffer)], "%4d", i);
+int field_width(int vertex_count) {
+    return (vertex_count * 3 / 2 < 10000) ? NARROW_FIELD_WIDTH : WIDE_FIELD_WIDTH;
+}
+
+int tag_field_width(char* tag, char* narrow_tag, char* wide_tag) {
+    if (strncmp(tag, narrow_tag, 4) == 0) return NARROW_FIELD_WIDTH;
+    if (strncmp(tag, wide_tag, 4) == 0) return WIDE_FIELD_WIDTH;
+    return -1;
+}
+
+void write_all(int fd, char* data, size_t count) {
+    while (count > 0) {
+        ssize_t written = write(fd, data, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            ERR("write");
+        }
+        data += written;
+        count -= written;
+    }
+}
+
+void flush_frame(Frame* frame) {
+    fflush(stdout);
+    write_all(STDOUT_FILENO, frame->data, frame->length);
+    frame->length = 0;
+}
+
+void frame_printf(Frame* frame, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t room = WRITE_BUFFER_SIZE - frame->length;
+    int length = vsnprintf(&frame->data[frame->length], room, format, args);
+    va_end(args);
+    if (length < 0) return;
+    if ((size_t) length >= room) {
+        flush_frame(frame);
+        va_start(args, format);
+        length = vsnprintf(frame->data, WRITE_BUFFER_SIZE, format, args);
+        va_end(args);
+        if (length < 0) return;
+        if (length >= WRITE_BUFFER_SIZE) length = WRITE_BUFFER_SIZE - 1;
+    }
+    frame->length += length;
+}
+
+TextBuffer* create_text_buffer(int fd, int field_width) {
+    TextBuffer* buffer = malloc(sizeof(TextBuffer));
+    if (buffer==NULL) ERR("malloc");
+    buffer->fd = fd;
+    buffer->field_width = field_width;
+    buffer->overflow = 0;
+    buffer->length = 0;
+    buffer->bytes_written = 0;
+    return buffer;
+}
+
+void flush_buffer(TextBuffer* buffer) {
+    write_all(buffer->fd, buffer->data, buffer->length);
+    buffer->bytes_written += buffer->length;
+    buffer->length = 0;
+}
+
+// Flushes the remaining data and returns the total number of bytes written.
+size_t close_text_buffer(TextBuffer* buffer) {
+    flush_buffer(buffer);
+    size_t bytes_written = buffer->bytes_written;
+    free(buffer);
+    return bytes_written;
+}
+
+void reserve_buffer(TextBuffer* buffer, size_t count) {
+    if (buffer->length + count > WRITE_BUFFER_SIZE) flush_buffer(buffer);
+}
+
+// A number wider than the field fills it with '#' and sets overflow and
+// errno, so the file is never read back as a different number.
+void int_to_buffer(TextBuffer* buffer, int i) {
+    reserve_buffer(buffer, buffer->field_width);
+    char* field = &buffer->data[buffer->length];
+    unsigned int value = i < 0 ? -(unsigned int) i : (unsigned int) i;
+    int pos = buffer->field_width;
+    do {
+        field[--pos] = '0' + value % 10;
+        value /= 10;
+    } while (value && pos > 0);
+    if (value || (i < 0 && pos == 0)) {
+        memset(field, '#', buffer->field_width);
+        buffer->overflow = 1;
+        errno = EOVERFLOW;
+        pos = 0;
+    }
+    if (i < 0 && pos > 0) field[--pos] = '-';
+    while (pos > 0) field[--pos] = ' ';
+    buffer->length += buffer->field_width;
+}
+
+void string_to_buffer(TextBuffer* buffer, char* s) {
+    size_t length = strlen(s);
+    reserve_buffer(buffer, length);
+    memcpy(&buffer->data[buffer->length], s, length);
+    buffer->length += length;
+}
+
+void endline_to_buffer(TextBuffer* buffer) {
+    reserve_buffer(buffer, 1);
+    buffer->data[buffer->length++] = '\n';
+}
+
+// Drops what is left of a line that was cut, newline included.
+void skip_cut_line(LineReader* reader) {
+    char* newline = memchr(reader->data, '\n', reader->length);
+    int taken = newline ? newline - reader->data + 1 : reader->length;
+    reader->length -= taken;
+    memmove(reader->data, reader->data + taken, reader->length);
+    if (newline) reader->discarding = 0;
+}
+
+// One read() into the free space of the reader.
+void fill_line_reader(LineReader* reader) {
+    if (reader->eof || reader->length == INPUT_BUFFER_SIZE) return;
+    ssize_t count = read(reader->fd, reader->data + reader->length, INPUT_BUFFER_SIZE - reader->length);
+    if (count < 0) {
+        if (errno == EINTR || errno == EAGAIN) return;
+        ERR("read");
+    }
+    if (count == 0) reader->eof = 1;
+    reader->length += count;
+    if (reader->discarding) skip_cut_line(reader);
+}
+
+// A full buffer without a newline is taken as one (cut) line, and so is
+// what is left at the end of the file.
+int line_waiting(LineReader* reader) {
+    return memchr(reader->data, '\n', reader->length) != NULL
+        || reader->length == INPUT_BUFFER_SIZE || (reader->eof && reader->length > 0);
+}
+
+// Takes the next line, without its newline, out of the reader. Returns 0
+// if there is none yet.
+int next_line(LineReader* reader, char* line) {
+    if (!line_waiting(reader)) return 0;
+    char* newline = memchr(reader->data, '\n', reader->length);
+    int taken = newline ? newline - reader->data + 1 : reader->length;
+    int count = newline ? taken - 1 : taken;
+    if (count > MAX_INPUT_LENGTH - 1) count = MAX_INPUT_LENGTH - 1;
+    memcpy(line, reader->data, count);
+    line[count] = '\0';
+    if (!newline && !reader->eof) reader->discarding = 1;
+    reader->length -= taken;
+    memmove(reader->data, reader->data + taken, reader->length);
+    return 1;
+}
+
+// Blocks until the next line. Returns 0 at the end of the file.
+int read_line(LineReader* reader, char* line) {
+    while (!next_line(reader, line)) {
+        if (reader->eof) return 0;
+        fill_line_reader(reader);
+    }
+    return 1;
+}
+
+int open_text_parser(TextParser* parser, char* path) {
+    int fd;
+    if ((fd = open(path, O_RDONLY))<0) ERR("open");
+
+    struct stat filestat;
+    if (fstat(fd, &filestat)) ERR("fstat");
+
+    parser->path = path;
+    parser->data = NULL;
+    parser->size = filestat.st_size;
+    parser->pos = 0;
+    parser->line = 1;
+    parser->line_start = 0;
+    parser->field_width = NARROW_FIELD_WIDTH;
+    parser->failed = 0;
+
+    if (parser->size > 0) {
+        parser->data = mmap(NULL, parser->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (parser->data == MAP_FAILED) ERR("mmap");
+    }
+    if (close(fd)) ERR("close");
+    return 0;
+}
+
+void close_text_parser(TextParser* parser) {
+    if (parser->data && munmap(parser->data, parser->size)) ERR("munmap");
+    parser->data = NULL;
+}
+
+void parser_error(TextParser* parser, char* format, ...) {
+    if (parser->failed) return;
+    parser->failed = 1;
+
+    va_list args;
+    va_start(args, format);
+    printf("\n[!] Error. %s:%d:%zu: ", parser->path, parser->line, parser->pos - parser->line_start + 1);
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+}
+
+void expect_tag(TextParser* parser, char* tag) {
+    if (parser->failed) return;
+    if (parser->pos + 4 > parser->size || strncmp(&parser->data[parser->pos], tag, 4) != 0) {
+        parser_error(parser, "expected \"%s\"", tag);
+        return;
+    }
+    parser->pos += 4;
 }
 
-void string_to_buffer(char* buffer, char* s) {
-    sprintf(&buffer[strlen(buffer)], "%s", s);
+// Consumes a narrow_tag or wide_tag and sets the field width accordingly.
+void expect_width_tag(TextParser* parser, char* narrow_tag, char* wide_tag) {
+    if (parser->failed) return;
+    int width = -1;
+    if (parser->pos + 4 <= parser->size) width = tag_field_width(&parser->data[parser->pos], narrow_tag, wide_tag);
+    if (width < 0) {
+        parser_error(parser, "expected \"%s\" or \"%s\"", narrow_tag, wide_tag);
+        return;
+    }
+    parser->field_width = width;
+    parser->pos += 4;
+}
+
+void expect_endline(TextParser* parser) {
+    if (parser->failed) return;
+    if (parser->pos >= parser->size || parser->data[parser->pos] != '\n') {
+        parser_error(parser, "expected end of line");
+        return;
+    }
+    parser->pos++;
+    parser->line++;
+    parser->line_start = parser->pos;
 }
 
-void endline_to_buffer(char* buffer) {
-    sprintf(&buffer[strlen(buffer)], "\n");
+// Decodes one right-aligned, fixed-width integer field in [min, max].
+int parse_field(TextParser* parser, int min, int max) {
+    if (parser->failed) return min;
+    int width = parser->field_width;
+    if (parser->pos + width > parser->size) {
+        parser_error(parser, "unexpected end of file");
+        return min;
+    }
+
+    char* field = &parser->data[parser->pos];
+    int k = 0;
+    while (k < width && field[k] == ' ') k++;
+    int negative = 0;
+    if (k < width && field[k] == '-') {
+        negative = 1;
+        k++;
+    }
+    if (k == width) {
+        parser_error(parser, "expected a number");
+        return min;
+    }
+
+    long long value = 0;
+    for (; k < width; k++) {
+        if (field[k] < '0' || field[k] > '9') {
+            parser->pos += k;
+            parser_error(parser, "unexpected character '%c' in a number", field[k]);
+            return min;
+        }
+        value = value * 10 + (field[k] - '0');
+    }
+    if (negative) value = -value;
+    if (value < min || value > max) {
+        parser_error(parser, "%lld is out of range [%d, %d]", value, min, max);
+        return min;
+    }
+    parser->pos += width;
+    return (int) value;
 }
 
 // 
 // END OF BUFFER MANIPULATION FUNCTIONS
 // 
 
+// 
+// RANDOM FUNCTIONS
+// 
+
+uint64_t splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void seed_rng(Rng* rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) rng->state[i] = splitmix64(&seed);
+}
+
+uint64_t rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t rng_next(Rng* rng) {
+    uint64_t* s = rng->state;
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return result;
+}
+
+// Uniform enough in [0, bound) for bound < 2^32, without a division.
+int rng_below(Rng* rng, int bound) {
+    return (int) (((rng_next(rng) >> 32) * (uint64_t) bound) >> 32);
+}
+
+// 
+// END OF RANDOM FUNCTIONS
+// 
+
 // 
 // QUEUE FUNCTIONS
 // 
@@ -119,26 +786,40 @@ void endline_to_buffer(char* buffer) {
 Queue* create_queue() {
     Queue* q = malloc(sizeof(Queue));
     if (q==NULL) ERR("malloc");
-    q->front = -1;
-    q->rear = -1;
+    q->capacity = 256;
+    q->items = (int*) malloc(q->capacity * sizeof(int));
+    if (q->items==NULL) ERR("malloc");
+    q->front = 0;
+    q->count = 0;
     return q;
 }
 
+void free_queue(Queue* q) {
+    free(q->items);
+    free(q);
+}
+
 int is_empty(Queue* q) {
-    if (q->rear == -1)
+    if (q->count == 0)
         return 1;
     else
         return 0;
 }
 
 void enqueue(Queue* q, int value) {
-    if (q->rear == MAX_QUEUE_SIZE - 1);
-    else {
-        if (q->front == -1)
-            q->front = 0;
-        q->rear++;
-        q->items[q->rear] = value;
+    if (q->count == q->capacity) {
+        int* items = (int*) malloc(2 * q->capacity * sizeof(int));
+        if (items==NULL) ERR("malloc");
+        for (int i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->front + i) & (q->capacity - 1)];
+        }
+        free(q->items);
+        q->items = items;
+        q->capacity *= 2;
+        q->front = 0;
     }
+    q->items[(q->front + q->count) & (q->capacity - 1)] = value;
+    q->count++;
 }
 
 int dequeue(Queue* q) {
@@ -148,10 +829,8 @@ int dequeue(Queue* q) {
     }
     else {
         item = q->items[q->front];
-        q->front++;
-        if (q->front > q->rear) {
-            q->front = q->rear = -1;
-        }
+        q->front = (q->front + 1) & (q->capacity - 1);
+        q->count--;
     }
     return item;
 }
@@ -160,17 +839,158 @@ int dequeue(Queue* q) {
 // END OF QUEUE FUNCTIONS
 // 
 
+// 
+// UNION-FIND FUNCTIONS
+// 
+
+UnionFind* create_union_find(int size) {
+    UnionFind* uf = malloc(sizeof(UnionFind));
+    if (uf==NULL) ERR("malloc");
+    uf->parent = (int*) malloc(size * sizeof(int));
+    if (uf->parent==NULL) ERR("malloc");
+    uf->rank = (int*) calloc(size, sizeof(int));
+    if (uf->rank==NULL) ERR("calloc");
+    for (int i = 0; i < size; i++) {
+        uf->parent[i] = i;
+    }
+    uf->count = size;
+    return uf;
+}
+
+void free_union_find(UnionFind* uf) {
+    free(uf->parent);
+    free(uf->rank);
+    free(uf);
+}
+
+int find_set(UnionFind* uf, int x) {
+    int root = x;
+    while (uf->parent[root] != root) {
+        root = uf->parent[root];
+    }
+    while (uf->parent[x] != root) {
+        int next = uf->parent[x];
+        uf->parent[x] = root;
+        x = next;
+    }
+    return root;
+}
+
+void union_sets(UnionFind* uf, int x, int y) {
+    x = find_set(uf, x);
+    y = find_set(uf, y);
+    if (x == y) return;
+    if (uf->rank[x] < uf->rank[y]) {
+        int temp = x;
+        x = y;
+        y = temp;
+    }
+    uf->parent[y] = x;
+    if (uf->rank[x] == uf->rank[y]) uf->rank[x]++;
+    uf->count--;
+}
+
+// 
+// END OF UNION-FIND FUNCTIONS
+// 
+
 // 
 // GRAPH FUNCTIONS
 // 
 
-AdjVertexNode* new_vertex_node(int id)
+void init_edge_index(EdgeIndex* index, int vertex_count, size_t expected_edges)
+{
+    index->bits = NULL;
+    index->keys = NULL;
+    index->count = 0;
+    if (vertex_count <= EDGE_BITSET_MAX_VERTICES) {
+        size_t words = ((size_t) vertex_count * vertex_count + 63) / 64;
+        index->capacity = words;
+        index->bits = (unsigned long long*) calloc(words ? words : 1, sizeof(unsigned long long));
+        if (index->bits==NULL) ERR("calloc");
+    } else {
+        index->capacity = 1024;
+        while (index->capacity < 2 * expected_edges) index->capacity *= 2;
+        index->keys = (unsigned long long*) malloc(index->capacity * sizeof(unsigned long long));
+        if (index->keys==NULL) ERR("malloc");
+        memset(index->keys, 0xFF, index->capacity * sizeof(unsigned long long));
+    }
+}
+
+void free_edge_index(EdgeIndex* index)
+{
+    free(index->bits);
+    free(index->keys);
+}
+
+unsigned long long edge_key(int i, int j)
+{
+    if (i > j) {
+        int temp = i;
+        i = j;
+        j = temp;
+    }
+    return ((unsigned long long) i << 32) | (unsigned int) j;
+}
+
+size_t edge_slot(EdgeIndex* index, unsigned long long key)
+{
+    size_t mask = index->capacity - 1;
+    size_t slot = (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 17) & mask;
+    while (index->keys[slot] != EDGE_HASH_EMPTY && index->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void grow_edge_index(EdgeIndex* index)
+{
+    unsigned long long* old_keys = index->keys;
+    size_t old_capacity = index->capacity;
+
+    index->capacity *= 2;
+    index->keys = (unsigned long long*) malloc(index->capacity * sizeof(unsigned long long));
+    if (index->keys==NULL) ERR("malloc");
+    memset(index->keys, 0xFF, index->capacity * sizeof(unsigned long long));
+
+    for (size_t k = 0; k < old_capacity; k++) {
+        if (old_keys[k] != EDGE_HASH_EMPTY) {
+            index->keys[edge_slot(index, old_keys[k])] = old_keys[k];
+        }
+    }
+    free(old_keys);
+}
+
+int edge_index_contains(EdgeIndex* index, int vertex_count, int i, int j)
+{
+    unsigned long long key = edge_key(i, j);
+    if (index->bits) {
+        size_t bit = (size_t) (key >> 32) * vertex_count + (key & 0xFFFFFFFFULL);
+        return (index->bits[bit / 64] >> (bit % 64)) & 1;
+    }
+    return index->keys[edge_slot(index, key)] == key;
+}
+
+// Returns 1 if the edge was not present before.
+int edge_index_insert(EdgeIndex* index, int vertex_count, int i, int j)
 {
-    AdjVertexNode* new_node = (AdjVertexNode*) malloc(sizeof(AdjVertexNode));
-    if (new_node == NULL) ERR("malloc");
-    new_node->id = id;
-    new_node->next = NULL;
-    return new_node;
+    unsigned long long key = edge_key(i, j);
+    if (index->bits) {
+        size_t bit = (size_t) (key >> 32) * vertex_count + (key & 0xFFFFFFFFULL);
+        unsigned long long mask = 1ULL << (bit % 64);
+        if (index->bits[bit / 64] & mask) return 0;
+        index->bits[bit / 64] |= mask;
+        index->count++;
+        return 1;
+    }
+    if (2 * (index->count + 1) > index->capacity) {
+        grow_edge_index(index);
+    }
+    size_t slot = edge_slot(index, key);
+    if (index->keys[slot] == key) return 0;
+    index->keys[slot] = key;
+    index->count++;
+    return 1;
 }
 
 Graph* new_graph(int vertex_count)
@@ -184,88 +1004,193 @@ Graph* new_graph(int vertex_count)
 
     for (int i = 0; i < vertex_count; i++) {
         graph->vertices[i].id = i;
-        graph->vertices[i].head = NULL;
         graph->vertices[i].items[0] = (Item) { .id = -1, .dest_vertex_id = -1 };
         graph->vertices[i].items[1] = (Item) { .id = -1, .dest_vertex_id = -1 };
         graph->vertices[i].assigned_item_ids[0] = -1;
         graph->vertices[i].assigned_item_ids[1] = -1;
     }
 
+    graph->offsets = (int*) calloc(vertex_count + 1, sizeof(int));
+    if (graph->offsets==NULL) ERR("calloc");
+    graph->neighbors = NULL;
+
+    graph->pending_edges = NULL;
+    graph->pending_count = 0;
+    graph->pending_capacity = 0;
+
+    graph->mapping = NULL;
+    graph->mapping_size = 0;
+
+    init_edge_index(&graph->edge_index, vertex_count, 0);
+    graph->topology_version = 0;
+
     return graph;
 }
 
-int are_connected(Graph* graph, int i, int j) 
+void release_adjacency(Graph* graph)
 {
-    AdjVertexNode* adj_vertex = graph->vertices[i].head;
-    while (adj_vertex) {
-        if (adj_vertex->id == j) {
-            return 1;
-        }
-        adj_vertex = adj_vertex->next;
+    if (graph->mapping) {
+        if (munmap(graph->mapping, graph->mapping_size)) ERR("munmap");
+        graph->mapping = NULL;
+        graph->mapping_size = 0;
+    } else {
+        free(graph->offsets);
+        free(graph->neighbors);
     }
-    return 0;
 }
 
-void add_edge(Graph* graph, int i, int j)
+void free_graph(Graph* graph)
+{
+    free(graph->vertices);
+    release_adjacency(graph);
+    free(graph->pending_edges);
+    free_edge_index(&graph->edge_index);
+    free(graph);
+}
+
+int adjacent_count(Graph* graph, int vertex_id) {
+    return graph->offsets[vertex_id + 1] - graph->offsets[vertex_id];
+}
+
+int compare_ints(const void* a, const void* b) {
+    int x = *(const int*) a;
+    int y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+int are_connected(Graph* graph, int i, int j) 
 {
-    AdjVertexNode* new_node = new_vertex_node(j);
-    new_node->next = graph->vertices[i].head;
-    graph->vertices[i].head = new_node;
+    if (i < 0 || j < 0 || i >= graph->vertex_count || j >= graph->vertex_count) return 0;
+    if (graph->mapping) return bsearch(&j, &graph->neighbors[graph->offsets[i]], adjacent_count(graph, i), sizeof(int), compare_ints) != NULL;
+    return edge_index_contains(&graph->edge_index, graph->vertex_count, i, j);
+}
 
-    new_node = new_vertex_node(i);
-    new_node->next = graph->vertices[j].head;
-    graph->vertices[j].head = new_node;
+void add_edge(Graph* graph, int i, int j)
+{
+    edge_index_insert(&graph->edge_index, graph->vertex_count, i, j);
+    if (graph->pending_count == graph->pending_capacity) {
+        graph->pending_capacity = graph->pending_capacity ? 2 * graph->pending_capacity : 64;
+        graph->pending_edges = (Edge*) realloc(graph->pending_edges, graph->pending_capacity * sizeof(Edge));
+        if (graph->pending_edges==NULL) ERR("realloc");
+    }
+    graph->pending_edges[graph->pending_count++] = (Edge) { .from = i, .to = j };
 }
 
+// Edges naming a room the graph does not have are ignored.
 void safe_add_edge(Graph* graph, int i, int j)
 {
+    if (i < 0 || j < 0 || i >= graph->vertex_count || j >= graph->vertex_count) return;
     if (!are_connected(graph, i, j)) {
         add_edge(graph, i, j);
     }
 }
 
-int adjacent_count(Vertex V) {
-    int count = 0;
-    AdjVertexNode* temp = V.head;
-    while (temp) {
-        count++;
-        temp = temp->next;
+void finalize_graph(Graph* graph)
+{
+    int n = graph->vertex_count;
+
+    int* offsets = (int*) calloc(n + 1, sizeof(int));
+    if (offsets==NULL) ERR("calloc");
+    for (int v = 0; v < n; v++) {
+        offsets[v + 1] = adjacent_count(graph, v);
+    }
+    for (int e = 0; e < graph->pending_count; e++) {
+        offsets[graph->pending_edges[e].from + 1]++;
+        offsets[graph->pending_edges[e].to + 1]++;
+    }
+    for (int v = 0; v < n; v++) {
+        offsets[v + 1] += offsets[v];
     }
-    return count;
-}
 
-int random_adjacent_id(Graph* graph, int room_id) {
-    int adj_count = adjacent_count(graph->vertices[room_id]);
-    AdjVertexNode* temp = graph->vertices[room_id].head;
-    int iterations = rand() % adj_count;
-    for (int i=0; i<iterations; i++) {
-        if (temp->next) {
-            temp = temp->next;
+    int* neighbors = (int*) malloc((offsets[n] + 1) * sizeof(int));
+    if (neighbors==NULL) ERR("malloc");
+    int* cursor = (int*) malloc((n + 1) * sizeof(int));
+    if (cursor==NULL) ERR("malloc");
+    memcpy(cursor, offsets, (n + 1) * sizeof(int));
+
+    for (int v = 0; v < n; v++) {
+        for (int k = graph->offsets[v]; k < graph->offsets[v + 1]; k++) {
+            neighbors[cursor[v]++] = graph->neighbors[k];
+        }
+    }
+    for (int e = 0; e < graph->pending_count; e++) {
+        Edge edge = graph->pending_edges[e];
+        neighbors[cursor[edge.from]++] = edge.to;
+        neighbors[cursor[edge.to]++] = edge.from;
+    }
+    free(cursor);
+
+    int written = 0;
+    int begin = 0;
+    for (int v = 0; v < n; v++) {
+        int end = offsets[v + 1];
+        qsort(&neighbors[begin], end - begin, sizeof(int), compare_ints);
+        offsets[v] = written;
+        for (int k = begin; k < end; k++) {
+            if (k == begin || neighbors[k] != neighbors[k - 1]) {
+                neighbors[written++] = neighbors[k];
+            }
         }
-    } 
-    return temp->id;
+        begin = end;
+    }
+    offsets[n] = written;
+
+    neighbors = (int*) realloc(neighbors, (written + 1) * sizeof(int));
+    if (neighbors==NULL) ERR("realloc");
+
+    release_adjacency(graph);
+    free(graph->pending_edges);
+    graph->offsets = offsets;
+    graph->neighbors = neighbors;
+    graph->pending_edges = NULL;
+    graph->pending_count = 0;
+    graph->pending_capacity = 0;
+    graph->topology_version++;
+}
+
+int random_adjacent_id(Graph* graph, int room_id, Rng* rng) {
+    int adj_count = adjacent_count(graph, room_id);
+    return graph->neighbors[graph->offsets[room_id] + rng_below(rng, adj_count)];
+}
+
+void print_room_info(Frame* frame, Graph* graph, int n, int player_location)
+{
+    frame_printf(frame, "\nRoom ID %d", n);
+    if (player_location == n) frame_printf(frame, " -----> [YOU ARE HERE]");
+    frame_printf(frame, "\nCurrent items [%d (dest %d), %d (dest %d)]\n", 
+        graph->vertices[n].items[0].id, graph->vertices[n].items[0].dest_vertex_id, 
+        graph->vertices[n].items[1].id, graph->vertices[n].items[1].dest_vertex_id);
+    frame_printf(frame, "Assigned item ids: [%d, %d]\n", graph->vertices[n].assigned_item_ids[0], graph->vertices[n].assigned_item_ids[1]);
+    frame_printf(frame, "Adjacent rooms: ");
+    for (int k = graph->offsets[n]; k < graph->offsets[n + 1]; k++)
+    {
+        frame_printf(frame, "%d ", graph->neighbors[k]);
+    }
+    frame_printf(frame, "\n");
 }
 
-void print_map_info(Graph* graph, int player_location)
+void print_map_info(Frame* frame, Graph* graph, int player_location)
 {
-    printf("\nMAP INFO\n");
+    frame_printf(frame, "\nMAP INFO\n");
     for (int n = 0; n < graph->vertex_count; n++)
     {
-        AdjVertexNode* adj_vertex = graph->vertices[n].head;
-        
-        printf("\nRoom ID %d", n);
-        if (player_location == n) printf(" -----> [YOU ARE HERE]");
-        printf("\nCurrent items [%d (dest %d), %d (dest %d)]\n", 
-            graph->vertices[n].items[0].id, graph->vertices[n].items[0].dest_vertex_id, 
+        print_room_info(frame, graph, n, player_location);
+    }
+}
+
+// The player's room in full, then the id and items of every room next to
+// it, so the output grows with the player's room alone.
+void print_surroundings_info(Frame* frame, Graph* graph, int player_location)
+{
+    frame_printf(frame, "\nSURROUNDINGS INFO\n");
+    print_room_info(frame, graph, player_location, player_location);
+    frame_printf(frame, "\nNext rooms:\n");
+    for (int k = graph->offsets[player_location]; k < graph->offsets[player_location + 1]; k++)
+    {
+        int n = graph->neighbors[k];
+        frame_printf(frame, "Room ID %d: items [%d (dest %d), %d (dest %d)]\n", n,
+            graph->vertices[n].items[0].id, graph->vertices[n].items[0].dest_vertex_id,
             graph->vertices[n].items[1].id, graph->vertices[n].items[1].dest_vertex_id);
-        printf("Assigned item ids: [%d, %d]\n", graph->vertices[n].assigned_item_ids[0], graph->vertices[n].assigned_item_ids[1]);
-        printf("Adjacent rooms: ");
-        while (adj_vertex)
-        {
-            printf("%d ", adj_vertex->id);
-            adj_vertex = adj_vertex->next;
-        }
-        printf("\n");
     }
 }
 
@@ -280,105 +1205,365 @@ int BFS(Graph* graph, int starting_id)
 
     while (!is_empty(q)) {
         int vertex_id = dequeue(q);
-        AdjVertexNode* curr = graph->vertices[vertex_id].head;
-        while (curr) {
-            int curr_id = curr->id;
+        for (int k = graph->offsets[vertex_id]; k < graph->offsets[vertex_id + 1]; k++) {
+            int curr_id = graph->neighbors[k];
 
             if (visited[curr_id] == 0) {
                 visited[curr_id] = 1;
                 enqueue(q, curr_id);
             }
-            curr = curr->next;
         }
     }
 
+    int connected = 1;
     for (int i = 0; i < graph->vertex_count; i++) {
         if (visited[i] == 0) {
-            return 0;
+            connected = 0;
+            break;
         }
     }
-    return 1;
+    free(visited);
+    free_queue(q);
+    return connected;
 }
 
-Graph* generate_random_graph(int vertex_count) {
-    Graph* graph = new_graph(vertex_count);
-    srand(time(NULL));
-    while (!BFS(graph, 0)) {
-        safe_add_edge(graph, rand() % vertex_count, rand() % vertex_count);
+// Writes the rooms after from, up to and including to, into path (room for
+// vertex_count entries) and returns the number of moves, or -1 if to
+// cannot be reached.
+int shortest_path(Graph* graph, int from, int to, int* path)
+{
+    int* parent = (int*) malloc(graph->vertex_count * sizeof(int));
+    if (parent==NULL) ERR("malloc");
+    for (int i = 0; i < graph->vertex_count; i++) {
+        parent[i] = -1;
     }
-    return graph;
-}
-
-int save_graph_to_file(Graph* graph, char* path) {
-    int fd;
-    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR ))< 0) ERR("open");
-
-    char buffer[1024*1024] = "";
-
-    string_to_buffer(buffer, "VERT");
-    int_to_buffer(buffer, graph->vertex_count);
-    endline_to_buffer(buffer);
-
-    for (int i=0; i<graph->vertex_count; i++) {
-        string_to_buffer(buffer, "ID: ");
-        int_to_buffer(buffer, i);
-
-        string_to_buffer(buffer, "ADJ:");
-        int adj = adjacent_count(graph->vertices[i]);
-        int_to_buffer(buffer, adj);
 
-        endline_to_buffer(buffer);
+    Queue* q = create_queue();
+    parent[from] = from;
+    enqueue(q, from);
 
-        AdjVertexNode* curr = graph->vertices[i].head;
-        for (int j=1; j<=adj; j++) {
-            int_to_buffer(buffer, curr->id);
-            curr = curr->next;
-            if (j == adj) {
-                endline_to_buffer(buffer);
+    while (!is_empty(q) && parent[to] == -1) {
+        int vertex_id = dequeue(q);
+        for (int k = graph->offsets[vertex_id]; k < graph->offsets[vertex_id + 1]; k++) {
+            int curr_id = graph->neighbors[k];
+            if (parent[curr_id] == -1) {
+                parent[curr_id] = vertex_id;
+                enqueue(q, curr_id);
             }
         }
     }
-
-    printf("%s", buffer);
-    if ((write(fd, buffer, strlen(buffer)))<0) ERR("write");
-    if (close(fd)) ERR("close");
-    return (EXIT_SUCCESS);
+    free_queue(q);
+
+    int length = -1;
+    if (parent[to] != -1) {
+        length = 0;
+        for (int v = to; v != from; v = parent[v]) length++;
+        int idx = length;
+        for (int v = to; v != from; v = parent[v]) path[--idx] = v;
+    }
+    free(parent);
+    return length;
 }
 
-Graph* read_graph_from_path(char* path) {
+void* build_route_rows(void* voidPtr) {
+    thread_routes* data = voidPtr;
+    Graph* graph = data->graph;
+    int n = graph->vertex_count;
+
+    int* frontier = (int*) malloc(n * sizeof(int));
+    if (frontier==NULL) ERR("malloc");
+
+    int source;
+    while ((source = __sync_fetch_and_add(data->next_source, 1)) < n) {
+        int* distance = &data->table->distance[(size_t) source * n];
+        int* next_hop = &data->table->next_hop[(size_t) source * n];
+        for (int v = 0; v < n; v++) {
+            distance[v] = -1;
+            next_hop[v] = -1;
+        }
 
-    int fd;
-    if ((fd = open(path, O_RDONLY))<0) ERR("open");
+        int head = 0;
+        int tail = 0;
+        distance[source] = 0;
+        next_hop[source] = source;
+        frontier[tail++] = source;
+        while (head < tail) {
+            int u = frontier[head++];
+            for (int k = graph->offsets[u]; k < graph->offsets[u + 1]; k++) {
+                int v = graph->neighbors[k];
+                if (distance[v] == -1) {
+                    distance[v] = distance[u] + 1;
+                    next_hop[v] = (u == source) ? v : next_hop[u];
+                    frontier[tail++] = v;
+                }
+            }
+        }
+    }
+    free(frontier);
+    return NULL;
+}
 
-    char buf[4];
-    char endl[1];
+// Runs one BFS per source room, spread over one thread per CPU.
+RouteTable* build_route_table(Graph* graph) {
+    int n = graph->vertex_count;
+    RouteTable* table = (RouteTable*) malloc(sizeof(RouteTable));
+    if (table==NULL) ERR("malloc");
+    table->vertex_count = n;
+    table->topology_version = graph->topology_version;
+    table->distance = (int*) malloc((size_t) n * n * sizeof(int));
+    if (table->distance==NULL) ERR("malloc");
+    table->next_hop = (int*) malloc((size_t) n * n * sizeof(int));
+    if (table->next_hop==NULL) ERR("malloc");
+
+    int threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads_count < 1) threads_count = 1;
+    if (threads_count > n) threads_count = n;
+
+    int next_source = 0;
+    thread_routes* datas = (thread_routes*) malloc(threads_count * sizeof(thread_routes));
+    if (datas==NULL) ERR("malloc");
+    for (int i=0; i<threads_count; i++) {
+        datas[i].graph = graph;
+        datas[i].table = table;
+        datas[i].next_source = &next_source;
+        int err = pthread_create(&datas[i].thread_id, NULL, build_route_rows, &datas[i]);
+        if (err != 0) ERR("pthread_create");
+    }
+    for (int i=0; i<threads_count; i++) {
+        int err = pthread_join(datas[i].thread_id, NULL);
+        if (err != 0) ERR("pthread_join");
+    }
+    free(datas);
+    return table;
+}
+
+void free_route_table(RouteTable* table) {
+    free(table->distance);
+    free(table->next_hop);
+    free(table);
+}
 
-    if ((read(fd, buf, 4))<0) ERR("read");
-    if ((read(fd, buf, 4))<0) ERR("read");
-    if ((read(fd, endl, 1))<0) ERR("read");
+size_t route_table_size(RouteTable* table) {
+    return 2 * (size_t) table->vertex_count * table->vertex_count * sizeof(int);
+}
+
+// Same contract as shortest_path().
+int route_table_path(RouteTable* table, int from, int to, int* path) {
+    int n = table->vertex_count;
+    int length = table->distance[(size_t) from * n + to];
+    int current = from;
+    for (int i = 0; i < length; i++) {
+        current = table->next_hop[(size_t) current * n + to];
+        path[i] = current;
+    }
+    return length;
+}
 
-    int vertex_count = atoi(buf);
+Graph* generate_random_graph(int vertex_count, Rng* rng) {
     Graph* graph = new_graph(vertex_count);
+    UnionFind* components = create_union_find(vertex_count);
+    while (components->count > 1) {
+        int i = rng_below(rng, vertex_count);
+        int j = rng_below(rng, vertex_count);
+        if (!are_connected(graph, i, j)) {
+            add_edge(graph, i, j);
+            union_sets(components, i, j);
+        }
+    }
+    free_union_find(components);
+    finalize_graph(graph);
+    return graph;
+}
+
+int has_binary_map_extension(char* path) {
+    size_t length = strlen(path);
+    size_t extension_length = strlen(BINARY_MAP_EXTENSION);
+    return length > extension_length && strcmp(&path[length - extension_length], BINARY_MAP_EXTENSION) == 0;
+}
+
+int save_binary_graph_to_file(Graph* graph, char* path) {
+    int fd;
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR ))< 0) ERR("open");
+
+    BinaryMapHeader header;
+    memcpy(header.magic, BINARY_MAP_MAGIC, 4);
+    header.version = BINARY_MAP_VERSION;
+    header.vertex_count = graph->vertex_count;
+    header.neighbor_count = graph->offsets[graph->vertex_count];
+
+    struct iovec iov[3];
+    iov[0] = (struct iovec) { .iov_base = &header, .iov_len = sizeof(header) };
+    iov[1] = (struct iovec) { .iov_base = graph->offsets, .iov_len = (graph->vertex_count + 1) * sizeof(int32_t) };
+    iov[2] = (struct iovec) { .iov_base = graph->neighbors, .iov_len = header.neighbor_count * sizeof(int32_t) };
+
+    int iov_index = 0;
+    while (iov_index < 3) {
+        ssize_t written = writev(fd, &iov[iov_index], 3 - iov_index);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            ERR("writev");
+        }
+        while (iov_index < 3 && (size_t) written >= iov[iov_index].iov_len) {
+            written -= iov[iov_index].iov_len;
+            iov_index++;
+        }
+        if (iov_index < 3) {
+            iov[iov_index].iov_base = (char*) iov[iov_index].iov_base + written;
+            iov[iov_index].iov_len -= written;
+        }
+    }
+    if (close(fd)) ERR("close");
+    return (EXIT_SUCCESS);
+}
 
-    for (int i=0; i<vertex_count; i++) {
-        if ((read(fd, buf, 4))<0) ERR("read");
-        if ((read(fd, buf, 4))<0) ERR("read");
-        if ((read(fd, buf, 4))<0) ERR("read");
-        if ((read(fd, buf, 4))<0) ERR("read");
-        if ((read(fd, endl, 1))<0) ERR("read");
+// The CSR arrays are used in place from a read-only mapping of the file,
+// they are only validated, never parsed or copied. The graph takes over
+// the mapping, it is unmapped right away if the file is invalid.
+// Rejects the file unless it has MIN_VERTEX_COUNT to max_vertex_count rooms
+// and every neighbor list is sorted, free of duplicates and matched by the
+// list of each neighbor, as the CSR arrays of Graph must be. As the lists
+// are visited in room order, room v shows up in the list of each neighbor
+// u in order too, so a cursor per room checks symmetry in one pass.
+Graph* read_binary_graph(void* mapping, size_t size, int max_vertex_count) {
+    if (size < sizeof(BinaryMapHeader)) {
+        if (munmap(mapping, size)) ERR("munmap");
+        return NULL;
+    }
 
-        int adjacent_count = atoi(buf);
+    BinaryMapHeader* header = mapping;
+    size_t expected_size = sizeof(BinaryMapHeader)
+        + ((size_t) header->vertex_count + 1) * sizeof(int32_t)
+        + (size_t) header->neighbor_count * sizeof(int32_t);
+    if (header->version != BINARY_MAP_VERSION || header->vertex_count < MIN_VERTEX_COUNT
+        || header->vertex_count > (uint32_t) max_vertex_count
+        || header->neighbor_count > INT32_MAX || size != expected_size) {
+        if (munmap(mapping, size)) ERR("munmap");
+        return NULL;
+    }
 
-        for (int j=0; j<adjacent_count; j++) {
-            
-            if ((read(fd, buf, 4))<0) ERR("read");
-            int vertex_id = atoi(buf);
-            safe_add_edge(graph, i, vertex_id);
+    int vertex_count = header->vertex_count;
+    int* offsets = (int*) ((char*) mapping + sizeof(BinaryMapHeader));
+    int* neighbors = offsets + vertex_count + 1;
 
-            if (j == adjacent_count-1) if ((read(fd, endl, 1))<0) ERR("read");
+    int valid = offsets[0] == 0 && offsets[vertex_count] == (int) header->neighbor_count;
+    for (int v = 0; valid && v < vertex_count; v++) {
+        if (offsets[v + 1] < offsets[v]) valid = 0;
+    }
+    int* cursor = NULL;
+    if (valid) {
+        cursor = (int*) malloc(vertex_count * sizeof(int));
+        if (cursor==NULL) ERR("malloc");
+        memcpy(cursor, offsets, vertex_count * sizeof(int));
+    }
+    for (int v = 0; valid && v < vertex_count; v++) {
+        for (int k = offsets[v]; valid && k < offsets[v + 1]; k++) {
+            int u = neighbors[k];
+            if (u < 0 || u >= vertex_count || (k > offsets[v] && neighbors[k - 1] >= u)) valid = 0;
+            else if (cursor[u] == offsets[u + 1] || neighbors[cursor[u]++] != v) valid = 0;
         }
     }
+    for (int v = 0; valid && v < vertex_count; v++) {
+        if (cursor[v] != offsets[v + 1]) valid = 0;
+    }
+    free(cursor);
+    if (!valid) {
+        if (munmap(mapping, size)) ERR("munmap");
+        return NULL;
+    }
+
+    Graph* graph = new_graph(vertex_count);
+    free(graph->offsets);
+    graph->offsets = offsets;
+    graph->neighbors = neighbors;
+    graph->mapping = mapping;
+    graph->mapping_size = size;
+    return graph;
+}
+
+int save_graph_to_file(Graph* graph, char* path) {
+    if (has_binary_map_extension(path)) return save_binary_graph_to_file(graph, path);
+
+    int fd;
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR ))< 0) ERR("open");
+
+    TextBuffer* buffer = create_text_buffer(fd, field_width(graph->vertex_count));
+
+    string_to_buffer(buffer, buffer->field_width == NARROW_FIELD_WIDTH ? "VERT" : "VRTW");
+    int_to_buffer(buffer, graph->vertex_count);
+    endline_to_buffer(buffer);
+
+    for (int i=0; i<graph->vertex_count; i++) {
+        string_to_buffer(buffer, "ID: ");
+        int_to_buffer(buffer, i);
+
+        string_to_buffer(buffer, "ADJ:");
+        int adj = adjacent_count(graph, i);
+        int_to_buffer(buffer, adj);
+
+        endline_to_buffer(buffer);
+
+        int* adjacent = &graph->neighbors[graph->offsets[i]];
+        for (int j=1; j<=adj; j++) {
+            int_to_buffer(buffer, adjacent[j-1]);
+            if (j == adj) {
+                endline_to_buffer(buffer);
+            }
+        }
+    }
+
+    int overflow = buffer->overflow;
+    close_text_buffer(buffer);
     if (close(fd)) ERR("close");
+    if (overflow) {
+        printf("\n[!] Error. A number of the map does not fit its field, %s was not saved.\n", path);
+        if (unlink(path)) ERR("unlink");
+        return EXIT_FAILURE;
+    }
+    return (EXIT_SUCCESS);
+}
+
+// Maps with fewer than MIN_VERTEX_COUNT or more than max_vertex_count
+// rooms are rejected.
+Graph* read_graph_from_path(char* path, int max_vertex_count) {
+    TextParser parser;
+    open_text_parser(&parser, path);
+
+    if (parser.size >= 4 && strncmp(parser.data, BINARY_MAP_MAGIC, 4) == 0) {
+        Graph* graph = read_binary_graph(parser.data, parser.size, max_vertex_count);
+        parser.data = NULL;
+        return graph;
+    }
+
+    expect_width_tag(&parser, "VERT", "VRTW");
+    int vertex_count = parse_field(&parser, MIN_VERTEX_COUNT, max_vertex_count);
+    expect_endline(&parser);
+    if (parser.failed) {
+        close_text_parser(&parser);
+        return NULL;
+    }
+
+    Graph* graph = new_graph(vertex_count);
+
+    for (int i=0; i<vertex_count && !parser.failed; i++) {
+        expect_tag(&parser, "ID: ");
+        parse_field(&parser, i, i);
+        expect_tag(&parser, "ADJ:");
+        int adjacent_count = parse_field(&parser, 0, vertex_count);
+        expect_endline(&parser);
+
+        for (int j=0; j<adjacent_count && !parser.failed; j++) {
+            int vertex_id = parse_field(&parser, 0, vertex_count - 1);
+            if (!parser.failed) safe_add_edge(graph, i, vertex_id);
+        }
+        if (adjacent_count > 0) expect_endline(&parser);
+    }
+
+    close_text_parser(&parser);
+    if (parser.failed) {
+        free_graph(graph);
+        return NULL;
+    }
+    finalize_graph(graph);
     return graph;
 }
 
@@ -426,25 +1611,30 @@ void dirfinder(char* dir_path, Graph* graph, int parent_id) {
     if (closedir(dirp)) ERR("closedir");
 }
 
-void map_from_dir_tree(char* dir_path, char* file_path) {
+void map_from_dir_tree(char* dir_path, char* file_path, int max_vertex_count) {
 
     char* cwd = realpath(".", NULL);
     nftw(dir_path, find_nftw_dir_count, MAX_FD, FTW_PHYS);
     printf("\n[*] %d directories found in %s\n", nftw_dir_count, dir_path);
     
-    if (nftw_dir_count < MIN_VERTEX_COUNT || nftw_dir_count > MAX_VERTEX_COUNT) {
-        printf("\n[!] Please choose another directory such that:\nn - total number of directories and subdirectories\nn > %d && n < %d\n", MIN_VERTEX_COUNT, MAX_VERTEX_COUNT);
+    if (nftw_dir_count < MIN_VERTEX_COUNT || nftw_dir_count > max_vertex_count) {
+        printf("\n[!] Please choose another directory such that:\nn - total number of directories and subdirectories\nn > %d && n < %d\n", MIN_VERTEX_COUNT, max_vertex_count);
     } else {
         Graph* graph = new_graph(nftw_dir_count);
         dirfinder_current_id = 0;
         dirfinder(dir_path, graph, 0);
-        print_map_info(graph, 0);
+        finalize_graph(graph);
+        Frame frame;
+        frame.length = 0;
+        print_map_info(&frame, graph, 0);
+        flush_frame(&frame);
 
         if (chdir(cwd)) ERR("chdir");
         printf("\n[*] Saving map to %s ...\n", file_path);
         int err = save_graph_to_file(graph, file_path);
         if (!err) printf("[*] Map saved\n");
         else printf("\n[!] Error while saving the map.");
+        free_graph(graph);
     }
 }
 
@@ -452,25 +1642,132 @@ void map_from_dir_tree(char* dir_path, char* file_path) {
 // END OF GRAPH FUNCTIONS
 // 
 
+// 
+// JOURNAL FUNCTIONS
+// 
+
+char* path_with_suffix(char* path, char* suffix) {
+    char* result = malloc(strlen(path) + strlen(suffix) + 1);
+    if (result==NULL) ERR("malloc");
+    strcpy(result, path);
+    strcat(result, suffix);
+    return result;
+}
+
+int next_journal_sequence(int sequence) {
+    return sequence % JOURNAL_SEQUENCE_LIMIT + 1;
+}
+
+void start_journal_file(Journal* journal) {
+    if ((journal->fd = open(journal->path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, S_IRUSR|S_IWUSR))<0) ERR("open");
+    journal->buffer->fd = journal->fd;
+    string_to_buffer(journal->buffer, "JRNL");
+    int_to_buffer(journal->buffer, journal->sequence);
+    endline_to_buffer(journal->buffer);
+    flush_buffer(journal->buffer);
+}
+
+// Sequence number in the header of the journal at path, 0 if there is none.
+int journal_file_sequence(char* path) {
+    char header[32] = "";
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (read(fd, header, sizeof(header) - 1) < 0) ERR("read");
+    if (close(fd)) ERR("close");
+    int sequence;
+    if (sscanf(header, "JRNL%d", &sequence) != 1) return 0;
+    return sequence;
+}
+
+// Starts an empty journal for the snapshot with the given sequence number,
+// which must already be on disk, and drops the journals of the one before.
+Journal* open_journal(char* save_path, int vertex_count, int sequence) {
+    Journal* journal = malloc(sizeof(Journal));
+    if (journal==NULL) ERR("malloc");
+    journal->path = path_with_suffix(save_path, ".journal");
+    journal->prev_path = path_with_suffix(save_path, ".journal.prev");
+    journal->sequence = sequence;
+    journal->unsynced = 0;
+    journal->buffer = create_text_buffer(-1, field_width(vertex_count));
+    start_journal_file(journal);
+    if (unlink(journal->prev_path) && errno != ENOENT) ERR("unlink");
+    return journal;
+}
+
+void close_journal(Journal* journal) {
+    if (close(journal->fd)) ERR("close");
+    close_text_buffer(journal->buffer);
+    free(journal->path);
+    free(journal->prev_path);
+    free(journal);
+}
+
+// Returns the sequence number of the snapshot the new, empty journal
+// belongs to. The old journal stays at prev_path until that snapshot is
+// safely on disk.
+int rotate_journal(Journal* journal) {
+    if (close(journal->fd)) ERR("close");
+    if (rename(journal->path, journal->prev_path)) ERR("rename");
+    journal->sequence = next_journal_sequence(journal->sequence);
+    start_journal_file(journal);
+    return journal->sequence;
+}
+
+// Appends one record with a single write.
+void journal_record(Journal* journal, char* tag, int* values, int count) {
+    if (journal == NULL) return;
+    string_to_buffer(journal->buffer, tag);
+    for (int k = 0; k < count; k++) {
+        int_to_buffer(journal->buffer, values[k]);
+    }
+    if (journal->buffer->overflow) ERR("journal_record");
+    endline_to_buffer(journal->buffer);
+    flush_buffer(journal->buffer);
+    journal->unsynced = 1;
+}
+
+// Makes the records written so far durable. Called once per batch of
+// commands and signals rather than per record.
+void sync_journal(Journal* journal) {
+    if (journal == NULL || !journal->unsynced) return;
+    if (fdatasync(journal->fd)) ERR("fdatasync");
+    journal->unsynced = 0;
+}
+
+// Logs a state change and marks the game dirty for the autosave.
+void record_change(Game* game, char* tag, int* values, int count) {
+    journal_record(game->journal, tag, values, count);
+
+    AutosaveSchedule* schedule = game->schedule;
+    if (schedule == NULL) return;
+    schedule->dirty_generation++;
+    clock_gettime(CLOCK_MONOTONIC, &schedule->last_change);
+}
+
+// 
+// END OF JOURNAL FUNCTIONS
+// 
+
 // 
 // PLAYER FUNCTIONS
 // 
 
-void print_player_info(Player* player) {
-    printf("PLAYER INFO\n");
-    printf("\nCurrent position: %d\n", player->location);
-    printf("Current items [%d (dest %d), %d (dest %d)]\n", 
+void print_player_info(Frame* frame, Player* player) {
+    frame_printf(frame, "PLAYER INFO\n");
+    frame_printf(frame, "\nCurrent position: %d\n", player->location);
+    frame_printf(frame, "Current items [%d (dest %d), %d (dest %d)]\n", 
             player->items[0].id, player->items[0].dest_vertex_id, 
             player->items[1].id, player->items[1].dest_vertex_id);
 }
 
-void player_move(Game* game, int vertex_id) {
+void player_move(Frame* frame, Game* game, int vertex_id) {
     int curr = game->player->location;
     if (are_connected(game->map, curr, vertex_id)) {
-        printf("\n[*] Moved to %d.\n", vertex_id);
+        frame_printf(frame, "\n[*] Moved to %d.\n", vertex_id);
         game->player->location = vertex_id;
+        record_change(game, "MOV:", &vertex_id, 1);
     } else {
-        printf("\n[!] Error. Rooms %d and %d are not connected.\n", curr, vertex_id);
+        frame_printf(frame, "\n[!] Error. Rooms %d and %d are not connected.\n", curr, vertex_id);
     }
 }
 
@@ -503,6 +1800,8 @@ int items_in_inventory(Player* player) {
     return items;
 }
 
+// Counts the items in the rooms and the inventory one by one, so the full
+// map can check the counters of the item index against the rooms.
 int total_item_count(Graph* graph, Player* player) {
     int count = 0;
     for (int i=0; i<graph->vertex_count; i++) {
@@ -512,104 +1811,224 @@ int total_item_count(Graph* graph, Player* player) {
     return count;
 }
 
+void index_item(ItemIndex* index, Item item, int room, int slot) {
+    if (item.id == -1) return;
+    index->room[item.id] = room;
+    index->slot[item.id] = slot;
+}
+
+void add_room(RoomSet* set, int room) {
+    set->position[room] = set->count;
+    set->rooms[set->count++] = room;
+}
+
+void remove_room(RoomSet* set, int room) {
+    int last = set->rooms[--set->count];
+    set->rooms[set->position[room]] = last;
+    set->position[last] = set->position[room];
+    set->position[room] = -1;
+}
+
+// Builds the index and the set of occupied rooms from scratch, once per
+// game.
+void build_item_index(Game* game) {
+    ItemIndex* index = &game->items;
+    index->item_count = game->map->vertex_count * 3 / 2;
+    index->room = (int*) malloc(index->item_count * sizeof(int));
+    if (index->room==NULL) ERR("malloc");
+    index->slot = (int*) malloc(index->item_count * sizeof(int));
+    if (index->slot==NULL) ERR("malloc");
+    for (int i=0; i<index->item_count; i++) {
+        index->room[i] = -1;
+        index->slot[i] = -1;
+    }
+
+    index->delivered = 0;
+    index->in_rooms = 0;
+    for (int i=0; i<game->map->vertex_count; i++) {
+        for (int k=0; k<2; k++) {
+            Item item = game->map->vertices[i].items[k];
+            if (item.id == -1) continue;
+            index_item(index, item, i, k);
+            index->in_rooms++;
+            if (item.dest_vertex_id == i) index->delivered++;
+        }
+    }
+    for (int k=0; k<2; k++) {
+        index_item(index, game->player->items[k], ITEM_IN_INVENTORY, k);
+    }
+    index->in_inventory = items_in_inventory(game->player);
+
+    RoomSet* occupied = &game->occupied;
+    occupied->rooms = (int*) malloc(game->map->vertex_count * sizeof(int));
+    if (occupied->rooms==NULL) ERR("malloc");
+    occupied->position = (int*) malloc(game->map->vertex_count * sizeof(int));
+    if (occupied->position==NULL) ERR("malloc");
+    occupied->count = 0;
+    for (int i=0; i<game->map->vertex_count; i++) {
+        occupied->position[i] = -1;
+        if (items_currently_count(game->map, i) > 0) add_room(occupied, i);
+    }
+}
+
+void free_item_index(Game* game) {
+    free(game->items.room);
+    free(game->items.slot);
+    free(game->occupied.rooms);
+    free(game->occupied.position);
+}
+
+// Returns the slot of the item in the given room, or in the inventory for
+// ITEM_IN_INVENTORY, and -1 if it is not there.
+int find_item(Game* game, int item_id, int room) {
+    if (item_id < 0 || item_id >= game->items.item_count) return -1;
+    if (game->items.room[item_id] != room) return -1;
+    return game->items.slot[item_id];
+}
+
+// Items get their destinations from the first item_count entries of a
+// shuffled list of all 2 * vertex_count room slots, and their current rooms
+// from a second shuffle of the same list. An item that starts in its own
+// destination trades slots with a random other slot, which takes O(1)
+// tries on average.
 void spawn_items(Game* game) {
-    int item_count = floor(game->map->vertex_count*3/2);
+    int vertex_count = game->map->vertex_count;
+    int item_count = vertex_count * 3 / 2;
+    int slot_count = 2 * vertex_count;
+
+    int* slots = (int*) malloc(slot_count * sizeof(int));
+    if (slots==NULL) ERR("malloc");
+    int* dest = (int*) malloc(item_count * sizeof(int));
+    if (dest==NULL) ERR("malloc");
+    for (int i=0; i<slot_count; i++) slots[i] = i / 2;
+
+    for (int round=0; round<2; round++) {
+        for (int i=0; i<item_count; i++) {
+            int j = i + rng_below(&game->rng, slot_count - i);
+            int temp = slots[i];
+            slots[i] = slots[j];
+            slots[j] = temp;
+            if (round == 0) dest[i] = slots[i];
+        }
+    }
+
+    for (int i=0; i<item_count; i++) {
+        while (slots[i] == dest[i]) {
+            int j = rng_below(&game->rng, slot_count);
+            if (slots[j] == dest[i] || (j < item_count && dest[j] == slots[i])) continue;
+            int temp = slots[i];
+            slots[i] = slots[j];
+            slots[j] = temp;
+        }
+    }
 
     for (int item_id=0; item_id<item_count; item_id++) {
+        Vertex* assigned = &game->map->vertices[dest[item_id]];
+        assigned->assigned_item_ids[items_assigned_count(game->map, dest[item_id])] = item_id;
 
-        int assigned_vertex_id = rand() % game->map->vertex_count;
-        while (items_assigned_count(game->map, assigned_vertex_id) == 2) 
-            assigned_vertex_id = rand() % game->map->vertex_count;
-        
-        game->map->vertices[assigned_vertex_id]
-        .assigned_item_ids[items_assigned_count(game->map, assigned_vertex_id)] = item_id;
+        int item_idx = items_currently_count(game->map, slots[item_id]);
+        game->map->vertices[slots[item_id]].items[item_idx].id = item_id;
+        game->map->vertices[slots[item_id]].items[item_idx].dest_vertex_id = dest[item_id];
+    }
+    free(slots);
+    free(dest);
+}
 
-        int current_vertex_id = rand() % game->map->vertex_count;
-        while (items_currently_count(game->map, current_vertex_id) == 2 || current_vertex_id == assigned_vertex_id)
-            current_vertex_id = rand() % game->map->vertex_count;
+// Item slots are kept compact: a room or an inventory holding one item
+// always has it in slot 0.
+void move_item_to_inventory(Game* game, int room_id, int room_idx) {
+    Vertex* room = &game->map->vertices[room_id];
+    int inventory_idx = items_in_inventory(game->player);
+    Item item = room->items[room_idx];
+    if (item.dest_vertex_id == room_id) game->items.delivered--;
+    game->items.in_rooms--;
+    game->items.in_inventory++;
+    game->player->items[inventory_idx] = item;
+    index_item(&game->items, item, ITEM_IN_INVENTORY, inventory_idx);
+    if (room_idx == 0) {
+        room->items[0] = room->items[1];
+        index_item(&game->items, room->items[0], room_id, 0);
+    }
+    room->items[1] = (Item) { .id = -1, .dest_vertex_id = -1 };
+    if (room->items[0].id == -1) remove_room(&game->occupied, room_id);
+}
 
-        int item_idx = items_currently_count(game->map, current_vertex_id);
-        game->map->vertices[current_vertex_id].items[item_idx].id = item_id;
-        game->map->vertices[current_vertex_id].items[item_idx].dest_vertex_id = assigned_vertex_id;
+void move_item_to_room(Game* game, int inventory_idx, int room_id) {
+    Vertex* room = &game->map->vertices[room_id];
+    int room_idx = items_currently_count(game->map, room_id);
+    if (room_idx == 0) add_room(&game->occupied, room_id);
+    Item item = game->player->items[inventory_idx];
+    if (item.dest_vertex_id == room_id) game->items.delivered++;
+    game->items.in_inventory--;
+    game->items.in_rooms++;
+    room->items[room_idx] = item;
+    index_item(&game->items, item, room_id, room_idx);
+    if (inventory_idx == 0) {
+        game->player->items[0] = game->player->items[1];
+        index_item(&game->items, game->player->items[0], ITEM_IN_INVENTORY, 0);
     }
+    game->player->items[1] = (Item) { .id = -1, .dest_vertex_id = -1 };
+}
+
+void swap_items(Game* game, int first_room, int idx_1, int second_room, int idx_2) {
+    Item first = game->map->vertices[first_room].items[idx_1];
+    Item second = game->map->vertices[second_room].items[idx_2];
+    game->items.delivered += (first.dest_vertex_id == second_room) + (second.dest_vertex_id == first_room)
+                           - (first.dest_vertex_id == first_room) - (second.dest_vertex_id == second_room);
+    game->map->vertices[first_room].items[idx_1] = second;
+    game->map->vertices[second_room].items[idx_2] = first;
+    index_item(&game->items, second, first_room, idx_1);
+    index_item(&game->items, first, second_room, idx_2);
 }
 
-void pickup_item(Game* game, int item_id) {
+void pickup_item(Frame* frame, Game* game, int item_id) {
     int room_id = game->player->location;
-    if (game->map->vertices[room_id].items[0].id == item_id || game->map->vertices[room_id].items[1].id == item_id) {
+    int room_idx = find_item(game, item_id, room_id);
+    if (room_idx >= 0) {
         if (items_in_inventory(game->player) < 2) {
-            int inventory_idx = items_in_inventory(game->player);
-            game->player->items[inventory_idx].id = item_id;
-
-            if (game->map->vertices[room_id].items[0].id == item_id) {
-                game->player->items[inventory_idx].dest_vertex_id = game->map->vertices[room_id].items[0].dest_vertex_id;
-                
-                game->map->vertices[room_id].items[0].id = game->map->vertices[room_id].items[1].id;
-                game->map->vertices[room_id].items[0].dest_vertex_id = game->map->vertices[room_id].items[1].dest_vertex_id;
-                game->map->vertices[room_id].items[1].id = -1;
-                game->map->vertices[room_id].items[1].dest_vertex_id = -1;
-            } else {
-                game->player->items[inventory_idx].dest_vertex_id = game->map->vertices[room_id].items[1].dest_vertex_id;
-                
-                game->map->vertices[room_id].items[1].id = -1;
-                game->map->vertices[room_id].items[1].dest_vertex_id = -1;
-            }
+            move_item_to_inventory(game, room_id, room_idx);
+            record_change(game, "PCK:", &item_id, 1);
         } else {
-            printf("\n[!] Error. Player's inventory is full.\n");
+            frame_printf(frame, "\n[!] Error. Player's inventory is full.\n");
         }
     } else {
-        printf("\n[!] Error. Item not found in Room %d.\n", room_id);
+        frame_printf(frame, "\n[!] Error. Item not found in Room %d.\n", room_id);
     }
 }
 
-void drop_item(Game* game, int item_id) {
+void drop_item(Frame* frame, Game* game, int item_id) {
     int room_id = game->player->location;
-    if (game->player->items[0].id == item_id || game->player->items[1].id == item_id) {
+    int inventory_idx = find_item(game, item_id, ITEM_IN_INVENTORY);
+    if (inventory_idx >= 0) {
         if (items_currently_count(game->map, room_id) < 2) {
-            int inventory_idx = items_currently_count(game->map, room_id);
-            game->map->vertices[room_id].items[inventory_idx].id = item_id;
-
-            if (game->player->items[0].id == item_id) {
-                game->map->vertices[room_id].items[inventory_idx].dest_vertex_id = game->player->items[0].dest_vertex_id;
-                
-                game->player->items[0].id = game->player->items[1].id;
-                game->player->items[0].dest_vertex_id = game->player->items[1].dest_vertex_id;
-                game->player->items[1].id = -1;
-                game->player->items[1].dest_vertex_id = -1;
-            } else {
-                game->map->vertices[room_id].items[inventory_idx].dest_vertex_id = game->player->items[1].dest_vertex_id;
-                
-                game->player->items[1].id = -1;
-                game->player->items[1].dest_vertex_id = -1;
-            }
+            move_item_to_room(game, inventory_idx, room_id);
+            record_change(game, "DRP:", &item_id, 1);
         } else {
-            printf("\n[!] Error. Room is full.\n");
+            frame_printf(frame, "\n[!] Error. Room is full.\n");
         }
     } else {
-        printf("\n[!] Error. Item not found in player's inventory.\n");
+        frame_printf(frame, "\n[!] Error. Item not found in player's inventory.\n");
     }
 }
 
 void swap_random_items(Game* game) {
-    srand(time(NULL));
-    int first_room = rand() % game->map->vertex_count;
-    int second_room = rand() % game->map->vertex_count;
-
-    while (items_currently_count(game->map, first_room) == 0)
-        first_room = rand() % game->map->vertex_count;
-    while (items_currently_count(game->map, second_room) == 0 || first_room == second_room)
-        second_room = rand() % game->map->vertex_count;
-
-    int idx_1 = rand() % items_currently_count(game->map, first_room);
-    int idx_2 = rand() % items_currently_count(game->map, second_room);
+    RoomSet* occupied = &game->occupied;
+    if (occupied->count < 2) {
+        fprintf(stderr, "\n[!] Error. Fewer than two rooms hold items, nothing to swap.\n");
+        return;
+    }
+    int first = rng_below(&game->rng, occupied->count);
+    int second = rng_below(&game->rng, occupied->count - 1);
+    if (second >= first) second++;
+    int first_room = occupied->rooms[first];
+    int second_room = occupied->rooms[second];
 
-    int temp_id = game->map->vertices[first_room].items[idx_1].id;
-    int temp_dest = game->map->vertices[first_room].items[idx_1].dest_vertex_id;
+    int idx_1 = rng_below(&game->rng, items_currently_count(game->map, first_room));
+    int idx_2 = rng_below(&game->rng, items_currently_count(game->map, second_room));
 
-    game->map->vertices[first_room].items[idx_1].id = game->map->vertices[second_room].items[idx_2].id;
-    game->map->vertices[first_room].items[idx_1].dest_vertex_id = game->map->vertices[second_room].items[idx_2].dest_vertex_id;
-    game->map->vertices[second_room].items[idx_2].id = temp_id;
-    game->map->vertices[second_room].items[idx_2].dest_vertex_id = temp_dest;
+    swap_items(game, first_room, idx_1, second_room, idx_2);
+    int record[4] = { first_room, idx_1, second_room, idx_2 };
+    record_change(game, "SWP:", record, 4);
 
     fprintf(stderr, "\n[*] Swapped item %d (dest %d) from Room ID %d with item %d (dest %d) from Room ID %d.\n",
         game->map->vertices[first_room].items[idx_1].id, game->map->vertices[first_room].items[idx_1].dest_vertex_id, second_room,
@@ -624,345 +2043,1198 @@ void swap_random_items(Game* game) {
 // GAME FUNCTIONS
 // 
 
-Game* new_game(Graph* map) {
-    srand(time(NULL));
-
+Game* new_game(Graph* map, uint64_t seed) {
     Game* game = (Game*) malloc(sizeof(Game));
     if (game==NULL) ERR("malloc");
 
     game->map = map;
+    game->routes = NULL;
+    game->journal = NULL;
+    game->schedule = NULL;
+    game->stats = NULL;
+    seed_rng(&game->rng, seed);
     game->player = (Player*) malloc(sizeof(Player));
     if (game->player==NULL) ERR("malloc");
 
-    game->player->location = rand() % map->vertex_count;
+    game->player->location = rng_below(&game->rng, map->vertex_count);
     game->player->items[0] = (Item) { .id = -1, .dest_vertex_id = -1 };
     game->player->items[1] = (Item) { .id = -1, .dest_vertex_id = -1 };
 
     spawn_items(game);
+    build_item_index(game);
     return game;
 }
 
-void print_game_state(Game* game) {
-    printf("\n-------- GAME STATE --------\n\n");
-    print_player_info(game->player);
-    print_map_info(game->map, game->player->location);
-    printf("\nITEMS IN TOTAL: %d [SHOULD BE %d]\n", total_item_count(game->map, game->player), (int) floor(game->map->vertex_count*3/2));
+void free_game(Game* game) {
+    free_graph(game->map);
+    free_item_index(game);
+    free(game->player);
+    free(game);
 }
 
-int save_game(Game* game, char* path) {
+// Shows every room when full_map is set, otherwise only the surroundings
+// of the player. The items are only counted room by room for the full map,
+// which visits every room anyway.
+void print_game_state(Frame* frame, Game* game, int full_map) {
+    frame_printf(frame, "\n-------- GAME STATE --------\n\n");
+    print_player_info(frame, game->player);
+    if (full_map) print_map_info(frame, game->map, game->player->location);
+    else print_surroundings_info(frame, game->map, game->player->location);
+    int total = game->items.in_rooms + game->items.in_inventory;
+    if (full_map) total = total_item_count(game->map, game->player);
+    frame_printf(frame, "\nITEMS IN TOTAL: %d [SHOULD BE %d]\n", total, (int) floor(game->map->vertex_count*3/2));
+    frame_printf(frame, "ITEMS DELIVERED: %d/%d\n", game->items.delivered, total);
+}
+
+uint64_t fnv1a(uint64_t hash, int value) {
+    for (int i = 0; i < 4; i++) {
+        hash ^= (value >> (8 * i)) & 0xff;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// FNV-1a over the player and every item slot, equal for equal game states.
+uint64_t game_checksum(Game* game) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = fnv1a(hash, game->player->location);
+    for (int k=0; k<2; k++) {
+        hash = fnv1a(hash, game->player->items[k].id);
+        hash = fnv1a(hash, game->player->items[k].dest_vertex_id);
+    }
+    for (int i=0; i<game->map->vertex_count; i++) {
+        for (int k=0; k<2; k++) {
+            hash = fnv1a(hash, game->map->vertices[i].items[k].id);
+            hash = fnv1a(hash, game->map->vertices[i].items[k].dest_vertex_id);
+        }
+    }
+    return hash;
+}
+
+GameSnapshot* take_snapshot(Game* game) {
+    GameSnapshot* snapshot = (GameSnapshot*) malloc(sizeof(GameSnapshot));
+    if (snapshot==NULL) ERR("malloc");
+    snapshot->map = game->map;
+    snapshot->player = *game->player;
+    snapshot->sequence = 0;
+    snapshot->items = malloc(game->map->vertex_count * sizeof(*snapshot->items));
+    if (snapshot->items==NULL) ERR("malloc");
+    for (int i=0; i<game->map->vertex_count; i++) {
+        snapshot->items[i][0] = game->map->vertices[i].items[0];
+        snapshot->items[i][1] = game->map->vertices[i].items[1];
+    }
+    return snapshot;
+}
+
+void free_snapshot(GameSnapshot* snapshot) {
+    free(snapshot->items);
+    free(snapshot);
+}
+
+int save_snapshot(GameSnapshot* snapshot, char* path) {
+    Graph* map = snapshot->map;
+    Player* player = &snapshot->player;
+
     int fd;
     if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR ))<0) ERR("open");
 
-    char buffer[1024*1024] = "";
+    TextBuffer* buffer = create_text_buffer(fd, field_width(map->vertex_count));
     
-    string_to_buffer(buffer, "PLYR");
+    string_to_buffer(buffer, buffer->field_width == NARROW_FIELD_WIDTH ? "PLYR" : "PLYW");
     endline_to_buffer(buffer);
 
     string_to_buffer(buffer, "POS:");
-    int_to_buffer(buffer, game->player->location);
+    int_to_buffer(buffer, player->location);
 
     string_to_buffer(buffer, "ITM:");
-    int_to_buffer(buffer, game->player->items[0].id);
-    int_to_buffer(buffer, game->player->items[0].dest_vertex_id);
-    int_to_buffer(buffer, game->player->items[1].id);
-    int_to_buffer(buffer, game->player->items[1].dest_vertex_id);
+    int_to_buffer(buffer, player->items[0].id);
+    int_to_buffer(buffer, player->items[0].dest_vertex_id);
+    int_to_buffer(buffer, player->items[1].id);
+    int_to_buffer(buffer, player->items[1].dest_vertex_id);
     endline_to_buffer(buffer);
 
-    string_to_buffer(buffer, "VERT");
-    int_to_buffer(buffer, game->map->vertex_count);
+    string_to_buffer(buffer, buffer->field_width == NARROW_FIELD_WIDTH ? "VERT" : "VRTW");
+    int_to_buffer(buffer, map->vertex_count);
     endline_to_buffer(buffer);
 
-    for (int i=0; i<game->map->vertex_count; i++) {
+    for (int i=0; i<map->vertex_count; i++) {
         string_to_buffer(buffer, "ID: ");
         int_to_buffer(buffer, i);
 
         string_to_buffer(buffer, "ITM:");
-        int_to_buffer(buffer, game->map->vertices[i].items[0].id);
-        int_to_buffer(buffer, game->map->vertices[i].items[0].dest_vertex_id);
-        int_to_buffer(buffer, game->map->vertices[i].items[1].id);
-        int_to_buffer(buffer, game->map->vertices[i].items[1].dest_vertex_id);
+        int_to_buffer(buffer, snapshot->items[i][0].id);
+        int_to_buffer(buffer, snapshot->items[i][0].dest_vertex_id);
+        int_to_buffer(buffer, snapshot->items[i][1].id);
+        int_to_buffer(buffer, snapshot->items[i][1].dest_vertex_id);
 
         string_to_buffer(buffer, "ASG:");
-        int_to_buffer(buffer, game->map->vertices[i].assigned_item_ids[0]);
-        int_to_buffer(buffer, game->map->vertices[i].assigned_item_ids[1]);
+        int_to_buffer(buffer, map->vertices[i].assigned_item_ids[0]);
+        int_to_buffer(buffer, map->vertices[i].assigned_item_ids[1]);
 
         string_to_buffer(buffer, "ADJ:");
-        int adj = adjacent_count(game->map->vertices[i]);
+        int adj = adjacent_count(map, i);
         int_to_buffer(buffer, adj);
         endline_to_buffer(buffer);
 
-        AdjVertexNode* curr = game->map->vertices[i].head;
+        int* adjacent = &map->neighbors[map->offsets[i]];
         for (int j=1; j<=adj; j++) {
-            int_to_buffer(buffer, curr->id);
-            curr = curr->next;
+            int_to_buffer(buffer, adjacent[j-1]);
             if (j == adj) endline_to_buffer(buffer);
         }
     }
-    if ((write(fd, buffer, strlen(buffer)))<0) ERR("write");
+
+    string_to_buffer(buffer, "SEQ:");
+    int_to_buffer(buffer, snapshot->sequence);
+    endline_to_buffer(buffer);
+
+    int overflow = buffer->overflow;
+    close_text_buffer(buffer);
+    if (fdatasync(fd)) ERR("fdatasync");
     if (close(fd)) ERR("close");
+    if (overflow) {
+        if (unlink(path)) ERR("unlink");
+        return EXIT_FAILURE;
+    }
     return (EXIT_SUCCESS);
 }
 
-Game* load_game(char* path) {
-    Game* game = (Game*) malloc(sizeof(Game));
-    if (game==NULL) ERR("malloc");
+int save_game(Game* game, char* path) {
+    GameSnapshot* snapshot = take_snapshot(game);
+    int err = save_snapshot(snapshot, path);
+    free_snapshot(snapshot);
+    return err;
+}
 
-    game->player = (Player*) malloc(sizeof(Player));
-    if (game->player==NULL) ERR("malloc");
+// The player record comes before the room count, so its fields are range
+// checked once the map size is known, reporting the position they came from.
+// sequence is set to the journal sequence the save was written with, or 0.
+Game* load_game(char* path, int* sequence, int max_vertex_count) {
+    TextParser parser;
+    open_text_parser(&parser, path);
+
+    expect_width_tag(&parser, "PLYR", "PLYW");
+    expect_endline(&parser);
+    expect_tag(&parser, "POS:");
+    TextParser location_field = parser;
+    int location = parse_field(&parser, 0, INT32_MAX);
+
+    expect_tag(&parser, "ITM:");
+    TextParser player_items_field = parser;
+    Item player_items[2];
+    for (int k=0; k<2; k++) {
+        player_items[k].id = parse_field(&parser, -1, INT32_MAX);
+        player_items[k].dest_vertex_id = parse_field(&parser, -1, INT32_MAX);
+    }
+    expect_endline(&parser);
 
-    int fd;
-    if ((fd = open(path, O_RDONLY))<0) ERR("open");
+    expect_width_tag(&parser, "VERT", "VRTW");
+    int entries = parse_field(&parser, MIN_VERTEX_COUNT, max_vertex_count);
+    expect_endline(&parser);
+
+    int item_count = entries * 3 / 2;
+    if (!parser.failed && location >= entries) {
+        parser_error(&location_field, "player position %d is not a room", location);
+        parser.failed = 1;
+    }
+    for (int k=0; k<2 && !parser.failed; k++) {
+        if (player_items[k].id >= item_count || player_items[k].dest_vertex_id >= entries) {
+            parser_error(&player_items_field, "player item %d (dest %d) does not fit the map",
+                player_items[k].id, player_items[k].dest_vertex_id);
+            parser.failed = 1;
+        }
+    }
+    if (parser.failed) {
+        close_text_parser(&parser);
+        return NULL;
+    }
+
+    Graph* map = new_graph(entries);
 
-    char buf[4] = "";
-    char endl[1] = "";
+    for (int i=0; i<entries && !parser.failed; i++) {
+        expect_tag(&parser, "ID: ");
+        parse_field(&parser, i, i);
 
-    if ((read(fd, buf, 4))<0) ERR("read");
-    if ((read(fd, endl, 1))<0) ERR("read");
-    if ((read(fd, buf, 4))<0) ERR("read");
-    if ((read(fd, buf, 4))<0) ERR("read");
-    int location = atoi(buf);
+        expect_tag(&parser, "ITM:");
+        for (int k=0; k<2; k++) {
+            map->vertices[i].items[k].id = parse_field(&parser, -1, item_count - 1);
+            map->vertices[i].items[k].dest_vertex_id = parse_field(&parser, -1, entries - 1);
+        }
+
+        expect_tag(&parser, "ASG:");
+        map->vertices[i].assigned_item_ids[0] = parse_field(&parser, -1, item_count - 1);
+        map->vertices[i].assigned_item_ids[1] = parse_field(&parser, -1, item_count - 1);
 
-    if ((read(fd, buf, 4))<0) ERR("read");
-    if ((read(fd, buf, 4))<0) ERR("read");
-    int player_item_1 = atoi(buf);
+        expect_tag(&parser, "ADJ:");
+        int adjacent_count = parse_field(&parser, 0, entries);
+        expect_endline(&parser);
 
-    if ((read(fd, buf, 4))<0) ERR("read");
-    int player_item_1_dest = atoi(buf);
+        for (int j=0; j<adjacent_count && !parser.failed; j++) {
+            int vertex_id = parse_field(&parser, 0, entries - 1);
+            if (!parser.failed) safe_add_edge(map, i, vertex_id);
+        }
+        if (adjacent_count > 0) expect_endline(&parser);
+    }
 
-    if ((read(fd, buf, 4))<0) ERR("read");
-    int player_item_2 = atoi(buf);
+    *sequence = 0;
+    if (parser.pos + 4 <= parser.size && strncmp(&parser.data[parser.pos], "SEQ:", 4) == 0) {
+        expect_tag(&parser, "SEQ:");
+        *sequence = parse_field(&parser, 0, JOURNAL_SEQUENCE_LIMIT);
+        expect_endline(&parser);
+    }
 
-    if ((read(fd, buf, 4))<0) ERR("read");
-    int player_item_2_dest = atoi(buf);
+    close_text_parser(&parser);
+    if (parser.failed) {
+        free_graph(map);
+        return NULL;
+    }
+    finalize_graph(map);
 
-    if ((read(fd, endl, 1))<0) ERR("read");
+    Game* game = (Game*) malloc(sizeof(Game));
+    if (game==NULL) ERR("malloc");
+
+    game->player = (Player*) malloc(sizeof(Player));
+    if (game->player==NULL) ERR("malloc");
 
     game->player->location = location;
-    game->player->items[0].id = player_item_1;
-    game->player->items[0].dest_vertex_id = player_item_1_dest;
-    game->player->items[1].id = player_item_2;
-    game->player->items[1].dest_vertex_id = player_item_2_dest;
+    game->player->items[0] = player_items[0];
+    game->player->items[1] = player_items[1];
+    game->map = map;
+    game->routes = NULL;
+    game->journal = NULL;
+    game->schedule = NULL;
+    game->stats = NULL;
+    build_item_index(game);
+    return game;
+}
 
-    if ((read(fd, buf, 4))<0) ERR("read");
-    if ((read(fd, buf, 4))<0) ERR("read");
-    if ((read(fd, endl, 1))<0) ERR("read");
-    int entries = atoi(buf);
+// Applies the records of a journal written for the given snapshot
+// sequence. Returns 1 if the journal belonged to that snapshot.
+int replay_journal(Game* game, char* path, int sequence) {
+    if (access(path, F_OK)) return 0;
 
-    Graph* map = new_graph(entries);
+    TextParser parser;
+    open_text_parser(&parser, path);
+    parser.field_width = field_width(game->map->vertex_count);
 
-    for (int i=0; i<entries; i++) {
-        if ((read(fd, buf, 4))<0) ERR("read");
-        if ((read(fd, buf, 4))<0) ERR("read");
-        if ((read(fd, buf, 4))<0) ERR("read");
+    expect_tag(&parser, "JRNL");
+    int journal_sequence = parse_field(&parser, 0, JOURNAL_SEQUENCE_LIMIT);
+    expect_endline(&parser);
+    if (parser.failed || journal_sequence != sequence) {
+        close_text_parser(&parser);
+        return 0;
+    }
 
-        if ((read(fd, buf, 4))<0) ERR("read");
-        int item_1 = atoi(buf);
+    int n = game->map->vertex_count;
+    int records = 0;
+    while (!parser.failed && parser.pos < parser.size) {
+        char* tag = &parser.data[parser.pos];
+        if (parser.pos + 4 <= parser.size && strncmp(tag, "MOV:", 4) == 0) {
+            expect_tag(&parser, "MOV:");
+            int room_id = parse_field(&parser, 0, n - 1);
+            if (!parser.failed && are_connected(game->map, game->player->location, room_id))
+                game->player->location = room_id;
+        } else if (parser.pos + 4 <= parser.size && strncmp(tag, "PCK:", 4) == 0) {
+            expect_tag(&parser, "PCK:");
+            int item_id = parse_field(&parser, 0, INT32_MAX);
+            int room_idx = find_item(game, item_id, game->player->location);
+            if (!parser.failed && room_idx >= 0 && items_in_inventory(game->player) < 2)
+                move_item_to_inventory(game, game->player->location, room_idx);
+        } else if (parser.pos + 4 <= parser.size && strncmp(tag, "DRP:", 4) == 0) {
+            expect_tag(&parser, "DRP:");
+            int item_id = parse_field(&parser, 0, INT32_MAX);
+            int inventory_idx = find_item(game, item_id, ITEM_IN_INVENTORY);
+            if (!parser.failed && inventory_idx >= 0 && items_currently_count(game->map, game->player->location) < 2)
+                move_item_to_room(game, inventory_idx, game->player->location);
+        } else if (parser.pos + 4 <= parser.size && strncmp(tag, "SWP:", 4) == 0) {
+            expect_tag(&parser, "SWP:");
+            int first_room = parse_field(&parser, 0, n - 1);
+            int idx_1 = parse_field(&parser, 0, 1);
+            int second_room = parse_field(&parser, 0, n - 1);
+            int idx_2 = parse_field(&parser, 0, 1);
+            if (!parser.failed && game->map->vertices[first_room].items[idx_1].id != -1
+                && game->map->vertices[second_room].items[idx_2].id != -1)
+                swap_items(game, first_room, idx_1, second_room, idx_2);
+        } else {
+            parser_error(&parser, "unknown journal record");
+        }
+        expect_endline(&parser);
+        if (!parser.failed) records++;
+    }
+    close_text_parser(&parser);
+    printf("\n[*] Replayed %d journal records from %s.\n", records, path);
+    return 1;
+}
 
-        if ((read(fd, buf, 4))<0) ERR("read");
-        int item_1_dest = atoi(buf);
+// Loads the save at path and replays the journals kept next to it. A
+// journal left at .journal.prev by an interrupted compaction belongs to the
+// snapshot before the current .journal.
+Game* restore_game(char* path, int max_vertex_count) {
+    int sequence;
+    Game* game = load_game(path, &sequence, max_vertex_count);
+    if (game == NULL || sequence == 0) return game;
+
+    char* journal_path = path_with_suffix(path, ".journal");
+    char* prev_path = path_with_suffix(path, ".journal.prev");
+    if (replay_journal(game, prev_path, sequence)) sequence = next_journal_sequence(sequence);
+    replay_journal(game, journal_path, sequence);
+    free(journal_path);
+    free(prev_path);
+    return game;
+}
 
-        if ((read(fd, buf, 4))<0) ERR("read");
-        int item_2 = atoi(buf);
+// Takes a snapshot for compaction and starts a new journal for it.
+GameSnapshot* begin_compaction(Game* game) {
+    GameSnapshot* snapshot = take_snapshot(game);
+    snapshot->sequence = rotate_journal(game->journal);
+    return snapshot;
+}
 
-        if ((read(fd, buf, 4))<0) ERR("read");
-        int item_2_dest = atoi(buf);
+// Makes a rename() in the directory holding path durable.
+void sync_parent_dir(char* path) {
+    char* copy = strdup(path);
+    if (copy==NULL) ERR("strdup");
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) ERR("open");
+    if (fsync(fd)) ERR("fsync");
+    if (close(fd)) ERR("close");
+    free(copy);
+}
 
-        map->vertices[i].items[0].id = item_1;
-        map->vertices[i].items[0].dest_vertex_id = item_1_dest;
-        map->vertices[i].items[1].id = item_2;
-        map->vertices[i].items[1].dest_vertex_id = item_2_dest;
+// Replaces the snapshot at path in one rename, which is on disk on return.
+int install_snapshot(GameSnapshot* snapshot, char* path) {
+    char* temp_path = path_with_suffix(path, ".tmp");
+    int err = save_snapshot(snapshot, temp_path);
+    if (!err) {
+        if (rename(temp_path, path)) ERR("rename");
+        sync_parent_dir(path);
+    }
+    free(temp_path);
+    return err;
+}
 
-        if ((read(fd, buf, 4))<0) ERR("read");
+// Writes the snapshot next to its journal and drops the old journal.
+int finish_compaction(Journal* journal, GameSnapshot* snapshot, char* path) {
+    int err = install_snapshot(snapshot, path);
+    if (!err && unlink(journal->prev_path) && errno != ENOENT) ERR("unlink");
+    return err;
+}
 
-        if ((read(fd, buf, 4))<0) ERR("read");
-        int assigned_item_1 = atoi(buf);
+// Saves the state a game starts from before the journals left at path are
+// touched, then starts the journal of the game. The snapshot gets a
+// sequence number none of those journals has, so a crash at any point
+// restores either the old snapshot with its journals or exactly this state.
+int start_autosave(Game* game, char* path) {
+    char* journal_path = path_with_suffix(path, ".journal");
+    char* prev_path = path_with_suffix(path, ".journal.prev");
+    int sequence = next_journal_sequence(journal_file_sequence(journal_path));
+    if (sequence == journal_file_sequence(prev_path)) sequence = next_journal_sequence(sequence);
+    free(journal_path);
+    free(prev_path);
+
+    GameSnapshot* snapshot = take_snapshot(game);
+    snapshot->sequence = sequence;
+    int err = install_snapshot(snapshot, path);
+    free_snapshot(snapshot);
+    game->journal = open_journal(path, game->map->vertex_count, sequence);
+    return err;
+}
 
-        if ((read(fd, buf, 4))<0) ERR("read");
-        int assigned_item_2 = atoi(buf);
+// 
+// END OF GAME FUNCTIONS
+// 
+
+// 
+// STATISTICS FUNCTIONS
+// 
 
-        map->vertices[i].assigned_item_ids[0] = assigned_item_1;
-        map->vertices[i].assigned_item_ids[1] = assigned_item_2;
+char* stat_command_names[STAT_COMMANDS] = { "move-to", "pick-up", "drop", "save", "find-path" };
 
-        if ((read(fd, buf, 4))<0) ERR("read");
+uint64_t timespec_ns(struct timespec* time) {
+    return (uint64_t) time->tv_sec * 1000000000ULL + time->tv_nsec;
+}
 
-        if ((read(fd, buf, 4))<0) ERR("read");
-        int adjacent_count = atoi(buf);
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_ns(&now);
+}
 
-        if ((read(fd, endl, 1))<0) ERR("read");
+int stat_command_index(char* command) {
+    for (int i = 0; i < STAT_COMMANDS; i++) {
+        if (strcmp(command, stat_command_names[i]) == 0) return i;
+    }
+    return -1;
+}
 
-        for (int j=0; j<adjacent_count; j++) {
-            
-            if ((read(fd, buf, 4))<0) ERR("read");
-            int vertex_id = atoi(buf);
-            safe_add_edge(map, i, vertex_id);
+void record_duration(Histogram* histogram, uint64_t ns) {
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= HISTOGRAM_BUCKETS) bucket = HISTOGRAM_BUCKETS - 1;
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-            if (j == adjacent_count-1) if ((read(fd, endl, 1))<0) ERR("read");
-        }
+// Upper bound of the bucket holding the given quantile, in nanoseconds,
+// but never above the largest duration seen.
+uint64_t histogram_quantile(Histogram* histogram, uint64_t count, double quantile) {
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    uint64_t rank = (uint64_t) ceil(quantile * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= rank) return (2ULL << i) < max ? (2ULL << i) : max;
     }
+    return max;
+}
 
-    if (close(fd)) ERR("close");
-    game->map = map;
-    return game;
+void print_histogram(Frame* frame, char* name, Histogram* histogram) {
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    if (count == 0) {
+        frame_printf(frame, "%-14s %8d\n", name, 0);
+        return;
+    }
+    frame_printf(frame, "%-14s %8llu %10.3f %10.3f %10.3f %10.3f\n", name, (unsigned long long) count,
+        __atomic_load_n(&histogram->total_ns, __ATOMIC_RELAXED) / 1e6 / count,
+        histogram_quantile(histogram, count, 0.5) / 1e6,
+        histogram_quantile(histogram, count, 0.99) / 1e6,
+        __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED) / 1e6);
+}
+
+// Quantiles are the upper bounds of power-of-two buckets.
+void print_stats(Frame* frame, Stats* stats) {
+    frame_printf(frame, "\nSTATS:\n");
+    frame_printf(frame, "%-14s %8s %10s %10s %10s %10s\n", "", "count", "mean ms", "p50 ms", "p99 ms", "max ms");
+    for (int i = 0; i < STAT_COMMANDS; i++) print_histogram(frame, stat_command_names[i], &stats->commands[i]);
+    print_histogram(frame, "autosave", &stats->autosave);
+    frame_printf(frame, "\nAutosaved bytes: %llu\n", (unsigned long long) __atomic_load_n(&stats->autosave_bytes, __ATOMIC_RELAXED));
+    uint64_t swaps = __atomic_load_n(&stats->swaps, __ATOMIC_RELAXED);
+    frame_printf(frame, "SIGUSR1 swaps: %llu in %llu batches, %.1f per second on average, at most %llu in one second\n",
+        (unsigned long long) swaps,
+        (unsigned long long) __atomic_load_n(&stats->swap_batches, __ATOMIC_RELAXED),
+        swaps / ((monotonic_ns() - stats->started_ns) / 1e9),
+        (unsigned long long) __atomic_load_n(&stats->peak_swaps_per_second, __ATOMIC_RELAXED));
 }
 
 // 
-// END OF GAME FUNCTIONS
+// END OF STATISTICS FUNCTIONS
 // 
 
 // 
 // THREAD FUNCTIONS
 // 
 
-void on_autosave_end() {
-    fprintf(stderr, "[*] Autosave thread ended successfully!\n");
-}
-
-void autosave(thread_autosave* data) {
-    struct timespec t = {1, 0};
-    struct timespec current;
-    fprintf(stderr, "[*] Autosave is enabled!\n");
-    pthread_cleanup_push((void *) on_autosave_end, NULL);
-    while(1) {
-        nanosleep(&t, NULL);
-        clock_gettime(CLOCK_REALTIME, &current);
-        if ((ELAPSED(data->game_state->last_saved, current)) > 60) {
-            fprintf(stderr, "\n[*] Autosaving to %s ...\n", data->path);
-            pthread_mutex_lock(data->pmxGameState);
-            int err = save_game(data->game_state, data->path);
-            pthread_mutex_unlock(data->pmxGameState);
-            if (!err) fprintf(stderr, "[*] Autosaved!\n");
-            else fprintf(stderr, "[!] Errow while autosaving\n");
-            clock_gettime(CLOCK_REALTIME, &data->game_state->last_saved);
+void print_msp(Frame* frame, int* path, int length) {
+    frame_printf(frame, "\nMODERATELY SHORT PATH:\n");
+    frame_printf(frame, "Current Room");
+    for (int i = 0; i < length; i++) {
+        frame_printf(frame, "->%d", path[i]);
+    }
+    frame_printf(frame, "\n");
+}
+
+// Walks at random from start_room, writing the rooms entered into path.
+// Returns the number of moves, or -1 if the walk got longer than
+// *best_length or MAX_WALK_LENGTH - 1 moves without reaching room_id, or
+// if it is stuck in a room without neighbors.
+int find_path(Graph* map, int start_room, int room_id, Rng* rng, int* path, int* best_length) {
+    int current_room_id = start_room;
+    for (int i = 0; i < MAX_WALK_LENGTH; i++) {
+        if (current_room_id == room_id) return i;
+        if (i >= __atomic_load_n(best_length, __ATOMIC_RELAXED)) return -1;
+        if (adjacent_count(map, current_room_id) == 0) return -1;
+        current_room_id = random_adjacent_id(map, current_room_id, rng);
+        path[i] = current_room_id;
+    }
+    return -1;
+}
+
+// Returns the number of moves of the shortest path from start_room to
+// room_id, or -1 if there is none. The route table is used when there is
+// one, it is rebuilt first, and *rebuilt set, if the map changed since it
+// was built.
+int exact_shortest_path(Game* game, int start_room, int room_id, int* path, int* rebuilt) {
+    *rebuilt = 0;
+    if (game->routes && game->routes->topology_version != game->map->topology_version) {
+        free_route_table(game->routes);
+        game->routes = build_route_table(game->map);
+        *rebuilt = 1;
+    }
+    if (game->routes) return route_table_path(game->routes, start_room, room_id, path);
+    return shortest_path(game->map, start_room, room_id, path);
+}
+
+// Called with the lock held after every finished job.
+void notify_search_done(PathfinderPool* pool) {
+    if (pool->walks_done < pool->walks_total || !pool->exact_done) return;
+    uint64_t one = 1;
+    pthread_cond_signal(&pool->cvDone);
+    if (write(pool->done_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) ERR("write");
+}
+
+void* pathfinder_worker(void* voidPtr) {
+    PathfinderPool* pool = voidPtr;
+    Rng rng;
+    int* path = (int*) malloc(MAX_WALK_LENGTH * sizeof(int));
+    if (path==NULL) ERR("malloc");
+
+    pthread_mutex_lock(&pool->mxPool);
+    while (1) {
+        while (!pool->stop && pool->walks_queued == 0 && !pool->exact_queued)
+            pthread_cond_wait(&pool->cvQueued, &pool->mxPool);
+        if (pool->stop) break;
+
+        if (pool->exact_queued) {
+            pool->exact_queued = 0;
+            int start_room = pool->start_room;
+            int room_id = pool->room_id;
+            pthread_mutex_unlock(&pool->mxPool);
+
+            int rebuilt;
+            uint64_t start = monotonic_ns();
+            int length = exact_shortest_path(pool->game_state, start_room, room_id, pool->exact_path, &rebuilt);
+            uint64_t ns = monotonic_ns() - start;
+
+            pthread_mutex_lock(&pool->mxPool);
+            pool->exact_length = length;
+            pool->exact_rebuilt = rebuilt;
+            pool->exact_ns = ns;
+            pool->exact_done = 1;
+            notify_search_done(pool);
+            continue;
+        }
+
+        int walk = --pool->walks_queued;
+        int start_room = pool->start_room;
+        int room_id = pool->room_id;
+        seed_rng(&rng, pool->seed ^ (pool->query << 32) ^ (uint64_t) walk);
+        pthread_mutex_unlock(&pool->mxPool);
+
+        int length = find_path(pool->game_state->map, start_room, room_id, &rng, path, &pool->best_length);
+
+        pthread_mutex_lock(&pool->mxPool);
+        if (length >= 0 && (length < pool->best_length
+            || (length == pool->best_length && walk < pool->best_walk))) {
+            memcpy(pool->best_path, path, length * sizeof(int));
+            __atomic_store_n(&pool->best_length, length, __ATOMIC_RELAXED);
+            pool->best_walk = walk;
         }
+        if (++pool->walks_done == pool->walks_total) pool->walks_end_ns = monotonic_ns();
+        notify_search_done(pool);
     }
-    pthread_cleanup_pop(1);
+    pthread_mutex_unlock(&pool->mxPool);
+    free(path);
+    return NULL;
 }
 
-int msp_length(msp_node* head) {
-    int count = 0;
-    msp_node* curr = head;
-    while (curr->next) {
-        count++;
-        curr = curr->next;
+// One worker per CPU.
+PathfinderPool* create_pathfinder_pool(Game* game, uint64_t seed) {
+    PathfinderPool* pool = (PathfinderPool*) malloc(sizeof(PathfinderPool));
+    if (pool==NULL) ERR("malloc");
+    if (pthread_mutex_init(&pool->mxPool, NULL)) ERR("pthread_mutex_init");
+    if (pthread_cond_init(&pool->cvQueued, NULL)) ERR("pthread_cond_init");
+    if (pthread_cond_init(&pool->cvDone, NULL)) ERR("pthread_cond_init");
+    pool->game_state = game;
+    pool->walks_queued = 0;
+    pool->walks_total = 0;
+    pool->walks_done = 0;
+    pool->exact_queued = 0;
+    pool->exact_done = 1;
+    pool->exact_path = (int*) malloc(game->map->vertex_count * sizeof(int));
+    if (pool->exact_path==NULL) ERR("malloc");
+    pool->best_path = (int*) malloc(MAX_WALK_LENGTH * sizeof(int));
+    if (pool->best_path==NULL) ERR("malloc");
+    pool->seed = seed;
+    pool->query = 0;
+    pool->stop = 0;
+    if ((pool->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ERR("eventfd");
+
+    pool->threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (pool->threads_count < 1) pool->threads_count = 1;
+    pool->threads = (pthread_t*) malloc(pool->threads_count * sizeof(pthread_t));
+    if (pool->threads==NULL) ERR("malloc");
+    for (int i=0; i<pool->threads_count; i++) {
+        int err = pthread_create(&pool->threads[i], NULL, pathfinder_worker, pool);
+        if (err != 0) ERR("pthread_create");
     }
-    return count;
+    return pool;
+}
+
+void free_pathfinder_pool(PathfinderPool* pool) {
+    pthread_mutex_lock(&pool->mxPool);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cvQueued);
+    pthread_mutex_unlock(&pool->mxPool);
+    for (int i=0; i<pool->threads_count; i++) {
+        int err = pthread_join(pool->threads[i], NULL);
+        if (err != 0) ERR("pthread_join");
+    }
+    pthread_cond_destroy(&pool->cvQueued);
+    pthread_cond_destroy(&pool->cvDone);
+    pthread_mutex_destroy(&pool->mxPool);
+    close(pool->done_fd);
+    free(pool->threads);
+    free(pool->best_path);
+    free(pool->exact_path);
+    free(pool);
+}
+
+// Queues the walks of one find-path, and the exact search if exact is
+// set, and returns at once.
+void submit_walks(PathfinderPool* pool, int walks_count, int room_id, int exact) {
+    pthread_mutex_lock(&pool->mxPool);
+    pool->start_room = pool->game_state->player->location;
+    pool->room_id = room_id;
+    pool->best_length = MAX_WALK_LENGTH;
+    pool->best_walk = -1;
+    pool->walks_total = walks_count;
+    pool->walks_done = 0;
+    pool->exact_queued = exact;
+    pool->exact_done = !exact;
+    pool->query++;
+    pool->walks_queued = walks_count;
+    pthread_cond_broadcast(&pool->cvQueued);
+    pthread_mutex_unlock(&pool->mxPool);
+}
+
+int search_finished(PathfinderPool* pool) {
+    pthread_mutex_lock(&pool->mxPool);
+    int finished = pool->walks_done == pool->walks_total && pool->exact_done;
+    pthread_mutex_unlock(&pool->mxPool);
+    return finished;
+}
+
+// Waits for the submitted walks and prints the best one. Returns its
+// number of moves, or -1 if no walk got there.
+int collect_walks(Frame* frame, PathfinderPool* pool) {
+    pthread_mutex_lock(&pool->mxPool);
+    while (pool->walks_done < pool->walks_total)
+        pthread_cond_wait(&pool->cvDone, &pool->mxPool);
+    int length = pool->best_length;
+    if (length == MAX_WALK_LENGTH) {
+        frame_printf(frame, "\n[!] Error. None of the walks reached room %d.\n", pool->room_id);
+        length = -1;
+    } else {
+        print_msp(frame, pool->best_path, length);
+    }
+    pthread_mutex_unlock(&pool->mxPool);
+    return length;
 }
 
-void print_msp(msp_node* head) {
-    msp_node* curr = head;
-    printf("\nMODERATELY SHORT PATH:\n");
-    printf("Current Room->");
-    while(curr->next) {
-        printf("%d", curr->room_id);
-        curr = curr->next;
-        if (curr->next) {
-            printf("->");
+int find_moderately_short_path(Frame* frame, PathfinderPool* pool, int walks_count, int room_id) {
+    submit_walks(pool, walks_count, room_id, 0);
+    return collect_walks(frame, pool);
+}
+
+void prepare_route_table(Frame* frame, Game* game) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    game->routes = build_route_table(game->map);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    frame_printf(frame, "\n[*] Route table for %d rooms built in %.3f s, using %.1f MiB.\n",
+        game->map->vertex_count, ELAPSED(start, end), route_table_size(game->routes) / (1024.0 * 1024.0));
+}
+
+// Prints the result of the exact search of a finished find-path and
+// returns its number of moves, or -1 if there is no path.
+int collect_exact_path(Frame* frame, PathfinderPool* pool) {
+    int length = pool->exact_length;
+    int* path = pool->exact_path;
+    int room_id = pool->room_id;
+    if (pool->exact_rebuilt) {
+        Game* game = pool->game_state;
+        frame_printf(frame, "\n[*] Route table for %d rooms rebuilt, using %.1f MiB.\n",
+            game->map->vertex_count, route_table_size(game->routes) / (1024.0 * 1024.0));
+    }
+    if (length < 0) {
+        frame_printf(frame, "\n[!] Error. Room %d cannot be reached.\n", room_id);
+    } else {
+        frame_printf(frame, "\nSHORTEST PATH:\n");
+        frame_printf(frame, "Current Room");
+        for (int i = 0; i < length; i++) {
+            frame_printf(frame, "->%d", path[i]);
         }
+        frame_printf(frame, "\n");
     }
-    printf("\n");
+    return length;
+}
+
+// 
+// END OF THREADS FUNCTIONS 
+// 
+
+// 
+// DELIVERY PLANNER FUNCTIONS
+// 
+
+int plan_distance(DeliveryPlanner* planner, int from, int to) {
+    return planner->routes->distance[(size_t) from * planner->vertex_count + to];
 }
 
-void* find_path(void* voidPtr) {
-    thread_pathfinder* data = voidPtr;
+void alloc_plan_state(DeliveryPlanner* planner, PlanState* state) {
+    state->room_items = (int*) malloc(2 * planner->vertex_count * sizeof(int));
+    if (state->room_items==NULL) ERR("malloc");
+    state->item_room = (int*) malloc(planner->item_count * sizeof(int));
+    if (state->item_room==NULL) ERR("malloc");
+    state->pending = (int*) malloc(planner->item_count * sizeof(int));
+    if (state->pending==NULL) ERR("malloc");
+    state->pending_count = 0;
+}
 
-    srand(data->thread_id);
+void free_plan_state(PlanState* state) {
+    free(state->room_items);
+    free(state->item_room);
+    free(state->pending);
+}
 
-    msp_node* result;
-    if (NULL==(result = (msp_node*) malloc(sizeof(msp_node)))) ERR("malloc");
-    result->room_id = data->game_state->player->location; 
-    result->next = NULL;
+void copy_plan_state(DeliveryPlanner* planner, PlanState* dst, PlanState* src) {
+    dst->location = src->location;
+    dst->carried[0] = src->carried[0];
+    dst->carried[1] = src->carried[1];
+    memcpy(dst->room_items, src->room_items, 2 * planner->vertex_count * sizeof(int));
+    memcpy(dst->item_room, src->item_room, planner->item_count * sizeof(int));
+    memcpy(dst->pending, src->pending, src->pending_count * sizeof(int));
+    dst->pending_count = src->pending_count;
+}
 
-    int current_room_id = result->room_id;
-    msp_node* temp = result;
+int plan_delivered(DeliveryPlanner* planner, PlanState* state, int item) {
+    return state->item_room[item] == planner->item_dest[item];
+}
 
-    for (int i=0; i<1000; i++) {
-        if (current_room_id == data->room_id) {
-            break;
+// Moves the player along a shortest path, printing a move-to command per
+// step to frame unless it is NULL. Returns the number of moves.
+int plan_walk(DeliveryPlanner* planner, PlanState* state, int room, Frame* frame) {
+    int length = plan_distance(planner, state->location, room);
+    if (frame) {
+        int current = state->location;
+        while (current != room) {
+            current = planner->routes->next_hop[(size_t) current * planner->vertex_count + room];
+            frame_printf(frame, "move-to %d\n", current);
         }
-        if (NULL==(temp->next = (msp_node*) malloc(sizeof(msp_node)))) ERR("malloc");
-        temp->room_id = random_adjacent_id(data->game_state->map, current_room_id);
-        current_room_id = temp->room_id;
-        temp = temp->next;
     }
+    state->location = room;
+    return length;
+}
 
-    return result;
+void plan_pick(PlanState* state, int item, Frame* frame) {
+    int* slots = &state->room_items[2 * state->location];
+    slots[slots[0] == item ? 0 : 1] = -1;
+    state->carried[state->carried[0] == -1 ? 0 : 1] = item;
+    state->item_room[item] = -1;
+    if (frame) frame_printf(frame, "pick-up %d\n", item);
 }
 
-void find_moderately_short_path(Game* game, int threads_count, int room_id) {
+void plan_drop(PlanState* state, int item, Frame* frame) {
+    int* slots = &state->room_items[2 * state->location];
+    slots[slots[0] == -1 ? 0 : 1] = item;
+    state->carried[state->carried[0] == item ? 0 : 1] = -1;
+    state->item_room[item] = state->location;
+    if (frame) frame_printf(frame, "drop %d\n", item);
+}
 
-    thread_pathfinder* datas = (thread_pathfinder*) malloc(threads_count * sizeof(thread_pathfinder));
-    if (datas==NULL) ERR("malloc");
-    msp_node* subresult;
-    msp_node* best_result;
+int nearest_free_room(DeliveryPlanner* planner, PlanState* state, int from) {
+    int best = -1;
+    for (int room = 0; room < planner->vertex_count; room++) {
+        if (state->room_items[2 * room] != -1 && state->room_items[2 * room + 1] != -1) continue;
+        if (best == -1 || plan_distance(planner, from, room) < plan_distance(planner, from, best)) best = room;
+    }
+    return best;
+}
 
-    srand(time(NULL));
-    for (int i=0; i<threads_count; i++) {
-        datas[i].game_state = game;
-        datas[i].room_id = room_id;
-        int err = pthread_create(&datas[i].thread_id, NULL, find_path, &datas[i]);
-        if (err != 0) ERR("pthread_create");
+// Remembers an item left short of its destination, once.
+void plan_postpone(PlanState* state, int item) {
+    for (int i = 0; i < state->pending_count; i++) {
+        if (state->pending[i] == item) return;
     }
-    
-    for (int i=0; i<threads_count; i++) {
-        int err = pthread_join(datas[i].thread_id, (void*) &subresult);
-        if (err != 0) ERR("pthread_join");
-        if (NULL != subresult) {
-            int new_path_length = msp_length(subresult);
-            if (best_result) {
-                int best_path_length = msp_length(best_result);
-                if (new_path_length < best_path_length) {
-                    free(best_result);
-                    best_result = subresult;
-                } else {
-                    free(subresult);
-                }
+    state->pending[state->pending_count++] = item;
+}
+
+// Returns a postponed item that is still not delivered, or -1.
+int plan_take_pending(DeliveryPlanner* planner, PlanState* state) {
+    while (state->pending_count > 0) {
+        int item = state->pending[--state->pending_count];
+        if (!plan_delivered(planner, state, item)) return item;
+    }
+    return -1;
+}
+
+int plan_room_full(PlanState* state, int room) {
+    return state->room_items[2 * room] != -1 && state->room_items[2 * room + 1] != -1;
+}
+
+// With one hand free, also takes an item waiting in the current room when
+// one of the two destinations has room for a drop and the detour through
+// the carried item's destination is no longer than going there directly.
+void plan_second_pick(DeliveryPlanner* planner, PlanState* state, Frame* frame) {
+    if (state->carried[0] == -1 || state->carried[1] != -1) return;
+    int carried_dest = planner->item_dest[state->carried[0]];
+    int* slots = &state->room_items[2 * state->location];
+    for (int slot = 0; slot < 2; slot++) {
+        int item = slots[slot];
+        if (item == -1 || plan_delivered(planner, state, item)) continue;
+        int dest = planner->item_dest[item];
+        if (plan_room_full(state, carried_dest) && plan_room_full(state, dest)) continue;
+        if (plan_distance(planner, carried_dest, dest) > plan_distance(planner, state->location, dest)) continue;
+        plan_pick(state, item, frame);
+        return;
+    }
+}
+
+// Plays the plan given by order on state and returns its number of moves.
+// The player fetches items in order and carries them to their
+// destinations. A full destination always holds an item that belongs
+// elsewhere, since no room is assigned more than two items, so that item
+// is picked up in exchange and carried on. When both destinations are
+// full, one item is put down in the nearest free room and fetched again
+// once order is done. When order is NULL the nearest undelivered item is
+// fetched next instead and the fetched items are written to chosen. The
+// moves are printed to frame unless it is NULL.
+int plan_moves(DeliveryPlanner* planner, PlanState* state, int* order, int* chosen, Frame* frame) {
+    int moves = 0;
+    int next = 0;
+    int chosen_count = 0;
+    while (1) {
+        int item = state->carried[0] != -1 ? state->carried[0] : state->carried[1];
+        if (state->carried[0] != -1 && state->carried[1] != -1) {
+            int other = state->carried[1];
+            int item_full = plan_room_full(state, planner->item_dest[item]);
+            int other_full = plan_room_full(state, planner->item_dest[other]);
+            if (item_full != other_full) {
+                if (item_full) item = other;
+            } else if (plan_distance(planner, state->location, planner->item_dest[other])
+                     < plan_distance(planner, state->location, planner->item_dest[item])) {
+                item = other;
+            }
+        }
+
+        if (item == -1) {
+            if (order) {
+                while (next < planner->order_count && plan_delivered(planner, state, order[next])) next++;
+                if (next < planner->order_count) item = order[next++];
             } else {
-                best_result = subresult;
+                for (int i = 0; i < planner->order_count; i++) {
+                    int candidate = planner->order[i];
+                    if (plan_delivered(planner, state, candidate)) continue;
+                    if (item == -1 || plan_distance(planner, state->location, state->item_room[candidate])
+                                    < plan_distance(planner, state->location, state->item_room[item]))
+                        item = candidate;
+                }
+                int repeat = 0;
+                for (int i = 0; item != -1 && i < chosen_count; i++) repeat |= chosen[i] == item;
+                if (item != -1 && !repeat) chosen[chosen_count++] = item;
             }
+            if (item == -1) item = plan_take_pending(planner, state);
+            if (item == -1) break;
+            moves += plan_walk(planner, state, state->item_room[item], frame);
+            plan_pick(state, item, frame);
+            plan_second_pick(planner, state, frame);
+            continue;
+        }
+
+        int dest = planner->item_dest[item];
+        int* slots = &state->room_items[2 * dest];
+        int hands_full = state->carried[0] != -1 && state->carried[1] != -1;
+        if (hands_full && plan_room_full(state, dest)) {
+            int other = state->carried[0] == item ? state->carried[1] : state->carried[0];
+            moves += plan_walk(planner, state, nearest_free_room(planner, state, dest), frame);
+            plan_drop(state, other, frame);
+            if (!plan_delivered(planner, state, other)) plan_postpone(state, other);
+            continue;
+        }
+        moves += plan_walk(planner, state, dest, frame);
+        if (plan_room_full(state, dest)) {
+            int slot = planner->item_dest[slots[0]] != dest ? 0 : 1;
+            if (planner->item_dest[slots[0]] != dest && planner->item_dest[slots[1]] != dest
+                && plan_distance(planner, dest, planner->item_dest[slots[1]])
+                 < plan_distance(planner, dest, planner->item_dest[slots[0]]))
+                slot = 1;
+            plan_pick(state, slots[slot], frame);
         }
+        plan_drop(state, item, frame);
+        plan_second_pick(planner, state, frame);
     }
-    if (msp_length(best_result)>999) {
-        printf("\n[!] Error. None of the threads reached room %d.\n", room_id);
-    } else {
-        print_msp(best_result);
+    return moves;
+}
+
+// Every carried move takes at most two items one room closer to where
+// they belong, and the item furthest out has to be fetched and delivered.
+int plan_lower_bound(DeliveryPlanner* planner) {
+    PlanState* state = &planner->initial;
+    int total = 0;
+    int furthest = 0;
+    for (int item = 0; item < planner->item_count; item++) {
+        int dest = planner->item_dest[item];
+        if (dest == -1 || plan_delivered(planner, state, item)) continue;
+        int room = state->item_room[item] == -1 ? state->location : state->item_room[item];
+        int length = plan_distance(planner, state->location, room) + plan_distance(planner, room, dest);
+        total += plan_distance(planner, room, dest);
+        if (length > furthest) furthest = length;
     }
-    free(best_result);
-    free(datas);
+    return (total + 1) / 2 > furthest ? (total + 1) / 2 : furthest;
 }
 
-void on_sighandler_end() {
-    fprintf(stderr, "[*] Signal handling thread ended successfully!\n");
+// Copies the item positions out of the game. Returns NULL if the game has no route table or a
+// room cannot be reached.
+DeliveryPlanner* create_delivery_planner(Frame* frame, Game* game) {
+    Graph* map = game->map;
+    if (game->routes == NULL) {
+        frame_printf(frame, "\n[!] Error. Planning needs the route table, start the game with -r %d or more.\n", map->vertex_count);
+        return NULL;
+    }
+    int* distance = &game->routes->distance[(size_t) game->player->location * map->vertex_count];
+    for (int room = 0; room < map->vertex_count; room++) {
+        if (distance[room] == -1) {
+            frame_printf(frame, "\n[!] Error. Room %d cannot be reached, not every item can be delivered.\n", room);
+            return NULL;
+        }
+    }
+
+    DeliveryPlanner* planner = (DeliveryPlanner*) malloc(sizeof(DeliveryPlanner));
+    if (planner==NULL) ERR("malloc");
+    planner->routes = game->routes;
+    planner->vertex_count = map->vertex_count;
+    planner->threads = NULL;
+    planner->item_count = 0;
+    for (int room = 0; room < map->vertex_count; room++) {
+        for (int slot = 0; slot < 2; slot++) {
+            if (map->vertices[room].items[slot].id >= planner->item_count)
+                planner->item_count = map->vertices[room].items[slot].id + 1;
+        }
+    }
+    for (int slot = 0; slot < 2; slot++) {
+        if (game->player->items[slot].id >= planner->item_count)
+            planner->item_count = game->player->items[slot].id + 1;
+    }
+
+    alloc_plan_state(planner, &planner->initial);
+    planner->item_dest = (int*) malloc(planner->item_count * sizeof(int));
+    if (planner->item_dest==NULL) ERR("malloc");
+    planner->order = (int*) malloc(planner->item_count * sizeof(int));
+    if (planner->order==NULL) ERR("malloc");
+    for (int item = 0; item < planner->item_count; item++) {
+        planner->item_dest[item] = -1;
+        planner->initial.item_room[item] = -1;
+    }
+
+    PlanState* state = &planner->initial;
+    state->location = game->player->location;
+    for (int slot = 0; slot < 2; slot++) {
+        Item item = game->player->items[slot];
+        state->carried[slot] = item.id;
+        if (item.id != -1) planner->item_dest[item.id] = item.dest_vertex_id;
+    }
+    planner->order_count = 0;
+    for (int room = 0; room < map->vertex_count; room++) {
+        for (int slot = 0; slot < 2; slot++) {
+            Item item = map->vertices[room].items[slot];
+            state->room_items[2 * room + slot] = item.id;
+            if (item.id == -1) continue;
+            planner->item_dest[item.id] = item.dest_vertex_id;
+            state->item_room[item.id] = room;
+            if (item.dest_vertex_id != room) planner->order[planner->order_count++] = item.id;
+        }
+    }
+    planner->lower_bound = plan_lower_bound(planner);
+
+    planner->nearby = (int*) malloc(PLAN_NEIGHBOURS * map->vertex_count * sizeof(int));
+    if (planner->nearby==NULL) ERR("malloc");
+    for (int room = 0; room < map->vertex_count; room++) {
+        int* nearby = &planner->nearby[PLAN_NEIGHBOURS * room];
+        int count = 0;
+        for (int i = 0; i < planner->order_count; i++) {
+            int item = planner->order[i];
+            int length = plan_distance(planner, room, state->item_room[item]);
+            int j = count < PLAN_NEIGHBOURS ? count++ : PLAN_NEIGHBOURS;
+            while (j > 0 && plan_distance(planner, room, state->item_room[nearby[j - 1]]) > length) {
+                if (j < PLAN_NEIGHBOURS) nearby[j] = nearby[j - 1];
+                j--;
+            }
+            if (j < PLAN_NEIGHBOURS) nearby[j] = item;
+        }
+        for (; count < PLAN_NEIGHBOURS; count++) nearby[count] = -1;
+    }
+    return planner;
 }
 
-void sigusr1_handler(thread_signal* data) {
-    sigset_t new_mask;
-    sigemptyset(&new_mask);
-    sigaddset(&new_mask, SIGUSR1);
+void free_delivery_planner(DeliveryPlanner* planner) {
+    free_plan_state(&planner->initial);
+    free(planner->item_dest);
+    free(planner->order);
+    free(planner->nearby);
+    free(planner);
+}
 
-    fprintf(stderr, "[*] Signal handling is enabled!\n");
-    pthread_cleanup_push((void *) on_sighandler_end, NULL);
-    int sig;
-    for (;;) {
-        if(sigwait(&new_mask, &sig)) ERR("sigwait");
-        switch (sig) {
-            case SIGUSR1:
-                fprintf(stderr,"\n[*] Signal handler catched SIGUSR1!\n");
-                fprintf(stderr,"[*] Swapping two random items...\n");
-                pthread_mutex_lock(data->pmxGameState);
-                swap_random_items(data->game_state);
-                pthread_mutex_unlock(data->pmxGameState);
-                
-                break;
-            default:
-                printf("[!] Unexpected signal!\n");
-                exit(EXIT_FAILURE);
+// Starts from the nearest-item-first order and keeps random segment
+// reversals and moves of single items that do not make the plan longer.
+// Most moves put an item waiting near the destination of another right
+// after it.
+void* plan_search(void* voidPtr) {
+    thread_planner* data = voidPtr;
+    DeliveryPlanner* planner = data->planner;
+    int n = planner->order_count;
+
+    PlanState state;
+    alloc_plan_state(planner, &state);
+    int* candidate = (int*) malloc(n * sizeof(int));
+    if (candidate==NULL) ERR("malloc");
+
+    copy_plan_state(planner, &state, &planner->initial);
+    data->moves = plan_moves(planner, &state, data->order, NULL, NULL);
+    data->evaluations = 1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (n > 1 && data->moves > planner->lower_bound && ELAPSED(now, data->deadline) > 0) {
+        int i = rng_below(&data->rng, n);
+        int j = rng_below(&data->rng, n);
+        memcpy(candidate, data->order, n * sizeof(int));
+        int kind = rng_below(&data->rng, 4);
+        if (kind > 1) {
+            int dest = planner->item_dest[candidate[i]];
+            int item = planner->nearby[PLAN_NEIGHBOURS * dest + rng_below(&data->rng, PLAN_NEIGHBOURS)];
+            int position = 0;
+            while (position < n && candidate[position] != item) position++;
+            if (position < n && position != i) {
+                j = position > i ? i + 1 : i;
+                i = position;
+            }
         }
+        if (kind == 0) {
+            for (int lo = i < j ? i : j, hi = i < j ? j : i; lo < hi; lo++, hi--) {
+                int temp = candidate[lo];
+                candidate[lo] = candidate[hi];
+                candidate[hi] = temp;
+            }
+        } else {
+            int item = candidate[i];
+            if (i < j) memmove(&candidate[i], &candidate[i + 1], (j - i) * sizeof(int));
+            else memmove(&candidate[j + 1], &candidate[j], (i - j) * sizeof(int));
+            candidate[j] = item;
+        }
+
+        copy_plan_state(planner, &state, &planner->initial);
+        int moves = plan_moves(planner, &state, candidate, NULL, NULL);
+        data->evaluations++;
+        if (moves <= data->moves) {
+            int* temp = data->order;
+            data->order = candidate;
+            candidate = temp;
+            data->moves = moves;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
     }
-    pthread_cleanup_pop(1);
+
+    free(candidate);
+    free_plan_state(&state);
+    uint64_t one = 1;
+    if (write(planner->done_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) ERR("write");
+    return NULL;
+}
+
+// Starts the search for budget_ms milliseconds on one thread per CPU and
+// returns at once. Each thread writes to done_fd when it stops.
+void start_plan_search(DeliveryPlanner* planner, uint64_t seed, int budget_ms, int done_fd) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    planner->start = start;
+    planner->done_fd = done_fd;
+
+    PlanState state;
+    alloc_plan_state(planner, &state);
+    int* greedy = (int*) malloc((planner->order_count + 1) * sizeof(int));
+    if (greedy==NULL) ERR("malloc");
+    int* seen = (int*) calloc(planner->item_count, sizeof(int));
+    if (seen==NULL) ERR("calloc");
+
+    // Items the greedy plan delivered on the way go to the end, so that
+    // every order the threads try still names every item.
+    for (int i = 0; i < planner->order_count; i++) greedy[i] = -1;
+    copy_plan_state(planner, &state, &planner->initial);
+    plan_moves(planner, &state, NULL, greedy, NULL);
+    int count = 0;
+    while (count < planner->order_count && greedy[count] != -1) seen[greedy[count++]] = 1;
+    for (int i = 0; i < planner->order_count; i++) {
+        if (!seen[planner->order[i]]) greedy[count++] = planner->order[i];
+    }
+    memcpy(planner->order, greedy, planner->order_count * sizeof(int));
+    free(seen);
+    free(greedy);
+    free_plan_state(&state);
+
+    int threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads_count < 1) threads_count = 1;
+    struct timespec deadline = start;
+    deadline.tv_sec += budget_ms / 1000;
+    deadline.tv_nsec += (budget_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    thread_planner* datas = (thread_planner*) malloc(threads_count * sizeof(thread_planner));
+    if (datas==NULL) ERR("malloc");
+    for (int i = 0; i < threads_count; i++) {
+        datas[i].planner = planner;
+        datas[i].deadline = deadline;
+        seed_rng(&datas[i].rng, seed ^ (uint64_t) i);
+        datas[i].order = (int*) malloc((planner->order_count + 1) * sizeof(int));
+        if (datas[i].order==NULL) ERR("malloc");
+        memcpy(datas[i].order, planner->order, planner->order_count * sizeof(int));
+        int err = pthread_create(&datas[i].thread_id, NULL, plan_search, &datas[i]);
+        if (err != 0) ERR("pthread_create");
+    }
+    planner->threads = datas;
+    planner->threads_count = threads_count;
+}
+
+// Joins the solver threads and prints the best plan as game commands.
+void finish_plan_search(Frame* frame, DeliveryPlanner* planner) {
+    struct timespec end;
+    thread_planner* datas = planner->threads;
+    int threads_count = planner->threads_count;
+    PlanState state;
+    alloc_plan_state(planner, &state);
+
+    int best = 0;
+    long evaluations = 0;
+    for (int i = 0; i < threads_count; i++) {
+        int err = pthread_join(datas[i].thread_id, NULL);
+        if (err != 0) ERR("pthread_join");
+        evaluations += datas[i].evaluations;
+        if (datas[i].moves < datas[best].moves) best = i;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    frame_printf(frame, "\nDELIVERY PLAN:\n");
+    copy_plan_state(planner, &state, &planner->initial);
+    int moves = plan_moves(planner, &state, datas[best].order, NULL, frame);
+
+    int delivered = 0;
+    int undelivered = 0;
+    for (int item = 0; item < planner->item_count; item++) {
+        if (planner->item_dest[item] == -1 || plan_delivered(planner, &planner->initial, item)) continue;
+        if (plan_delivered(planner, &state, item)) delivered++;
+        else undelivered++;
+    }
+    frame_printf(frame, "\n[*] Plan delivers %d items in %d moves, found in %.3f s (%ld plans on %d threads).\n",
+        delivered, moves, ELAPSED(planner->start, end), evaluations, threads_count);
+    if (undelivered > 0) frame_printf(frame, "[!] Error. The plan leaves %d items undelivered.\n", undelivered);
+    if (planner->lower_bound > 0) {
+        frame_printf(frame, "[*] Lower bound %d moves, optimality gap at most %.1f%%.\n",
+            planner->lower_bound, 100.0 * (moves - planner->lower_bound) / planner->lower_bound);
+    } else {
+        frame_printf(frame, "[*] Lower bound %d moves, the plan is optimal.\n", planner->lower_bound);
+    }
+
+    for (int i = 0; i < threads_count; i++) free(datas[i].order);
+    free(datas);
+    planner->threads = NULL;
+    free_plan_state(&state);
 }
 
 // 
-// END OF THREADS FUNCTIONS 
+// END OF DELIVERY PLANNER FUNCTIONS
 // 
 
 // 
@@ -970,180 +3242,633 @@ void sigusr1_handler(thread_signal* data) {
 // 
 
 void usage(char *name){
-    fprintf(stderr,"[!] USAGE: %s -b <backup-path>\n",name);
+    fprintf(stderr,"[!] USAGE: %s [-b <backup-path>] [-l] [-i <seconds>] [-d <seconds>] [-r <rooms>] [-s <seed>] [-x <script>]\n",name);
+    fprintf(stderr,"    -l  large-map mode, allows maps of up to %d rooms\n", MAX_LARGE_VERTEX_COUNT);
+    fprintf(stderr,"    -i  minimal time between autosaves (default %d)\n", AUTOSAVE_INTERVAL);
+    fprintf(stderr,"    -d  time without changes before an autosave (default %d)\n", AUTOSAVE_DEBOUNCE);
+    fprintf(stderr,"    -r  largest map with a precomputed route table (default %d, 0 disables it)\n", ROUTE_TABLE_MAX_VERTICES);
+    fprintf(stderr,"    -s  seed of every random choice (default taken from the clock, 0 with -x)\n");
+    fprintf(stderr,"    -x  run the commands of a script (- for stdin) without menus and game state,\n");
+    fprintf(stderr,"        and without autosave unless -b or $GAME_AUTOSAVE names a path\n");
     exit(EXIT_FAILURE);
 }
 
-char* get_backup_path(int argc, char** argv) {
-    if (argc == 3) {
-        if (strcmp(argv[1], "-b") == 0) {
-            return argv[2];
-        } else {
-            usage(argv[0]);
+Options get_options(int argc, char** argv) {
+    Options options;
+    options.backup_path = NULL;
+    options.max_vertex_count = MAX_VERTEX_COUNT;
+    options.autosave_interval = AUTOSAVE_INTERVAL;
+    options.autosave_debounce = AUTOSAVE_DEBOUNCE;
+    options.route_table_max_vertices = ROUTE_TABLE_MAX_VERTICES;
+    options.seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    options.seed_given = 0;
+    options.script_path = NULL;
+    options.script = NULL;
+
+    int c;
+    char* end;
+    while ((c = getopt(argc, argv, "b:li:d:r:s:x:")) != -1) {
+        switch (c) {
+            case 'b':
+                options.backup_path = optarg;
+                break;
+            case 'l':
+                options.max_vertex_count = MAX_LARGE_VERTEX_COUNT;
+                break;
+            case 'i':
+                options.autosave_interval = atoi(optarg);
+                if (options.autosave_interval < 0) usage(argv[0]);
+                break;
+            case 'd':
+                options.autosave_debounce = atoi(optarg);
+                if (options.autosave_debounce < 0) usage(argv[0]);
+                break;
+            case 'r':
+                options.route_table_max_vertices = atoi(optarg);
+                if (options.route_table_max_vertices < 0) usage(argv[0]);
+                break;
+            case 's':
+                options.seed = strtoull(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0') usage(argv[0]);
+                options.seed_given = 1;
+                break;
+            case 'x':
+                options.script_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
         }
     }
-    char* env = getenv("GAME_AUTOSAVE");
-    if (env) return env;
-    return ".game-autosave";
-} 
+    if (optind != argc) usage(argv[0]);
+
+    // Scripts leave no autosave behind unless they are given a path.
+    if (options.backup_path == NULL) options.backup_path = getenv("GAME_AUTOSAVE");
+    if (options.backup_path == NULL && options.script_path == NULL) options.backup_path = ".game-autosave";
+
+    if (options.script_path) {
+        options.script = (Script*) calloc(1, sizeof(Script));
+        if (options.script==NULL) ERR("calloc");
+        if (!options.seed_given) options.seed = 0;
+    }
+    return options;
+}
+
+void record_command_time(Script* script, char* name, struct timespec* start) {
+    if (script == NULL) return;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = ELAPSED(*start, end) * 1000;
+
+    int i = 0;
+    while (i < script->kinds && strcmp(script->commands[i].name, name) != 0) i++;
+    if (i == script->kinds) {
+        if (script->kinds == MAX_COMMAND_KINDS) return;
+        script->kinds++;
+        strcpy(script->commands[i].name, name);
+    }
+    CommandTiming* timing = &script->commands[i];
+    timing->count++;
+    timing->total += elapsed;
+    if (elapsed > timing->max) timing->max = elapsed;
+}
+
+void print_script_summary(Script* script) {
+    printf("\nSCRIPT SUMMARY:\n");
+    printf("%-20s %8s %12s %12s %12s\n", "command", "count", "total ms", "mean ms", "max ms");
+    for (int i = 0; i < script->kinds; i++) {
+        CommandTiming* timing = &script->commands[i];
+        printf("%-20s %8d %12.3f %12.3f %12.3f\n", timing->name, timing->count,
+            timing->total, timing->total / timing->count, timing->max);
+    }
+    if (script->has_checksum) printf("\n[*] Final state checksum: %016llx\n", (unsigned long long) script->checksum);
+}
 
 void show_main_menu() {
     printf("\nMAIN MENU:\n");
     printf("# read-map <map-path>\n");
     printf("# map-from-dir-tree <dir-path> <out-path>\n");
     printf("# generate-random-map <number-of-rooms> <out-path>\n");
+    printf("#   (maps saved to an <out-path> ending with %s use the binary format)\n", BINARY_MAP_EXTENSION);
     printf("# load-game <save-path>\n");
     printf("# exit\n");
 }
 
-void show_game_menu() {
-    printf("\nGAME MENU:\n");
-    printf("# move-to <room>\n");
-    printf("# pick-up <item>\n");
-    printf("# drop <item>\n");
-    printf("# save <save-path>\n");
-    printf("# find-path <number-of-threads> <room>\n");
-    printf("# sigusr1\n");
-    printf("# quit\n");
+void show_game_menu(Frame* frame) {
+    frame_printf(frame, "\nGAME MENU:\n");
+    frame_printf(frame, "# move-to <room>\n");
+    frame_printf(frame, "# pick-up <item>\n");
+    frame_printf(frame, "# drop <item>\n");
+    frame_printf(frame, "# save <save-path>\n");
+    frame_printf(frame, "# find-path <number-of-walks> <room>\n");
+    frame_printf(frame, "# plan-deliveries <milliseconds>\n");
+    frame_printf(frame, "# show-map\n");
+    frame_printf(frame, "# stats\n");
+    frame_printf(frame, "# sigusr1\n");
+    frame_printf(frame, "# quit\n");
 }
 
-void start_game(Game* game, char* backup_path) {
-    char user[MAX_INPUT_LENGTH];
-    char arg[MAX_INPUT_LENGTH];
+AutosaveSchedule* create_autosave_schedule(int interval, int debounce) {
+    AutosaveSchedule* schedule = malloc(sizeof(AutosaveSchedule));
+    if (schedule==NULL) ERR("malloc");
+    schedule->dirty_generation = 0;
+    schedule->saved_generation = 0;
+    clock_gettime(CLOCK_MONOTONIC, &schedule->last_saved);
+    schedule->last_change = schedule->last_saved;
+    schedule->interval = interval;
+    schedule->debounce = debounce;
+    return schedule;
+}
 
-    print_game_state(game);
-    show_game_menu();
+struct timespec autosave_deadline(AutosaveSchedule* schedule) {
+    struct timespec deadline = schedule->last_saved;
+    deadline.tv_sec += schedule->interval;
+    struct timespec debounced = schedule->last_change;
+    debounced.tv_sec += schedule->debounce;
+    if (ELAPSED(deadline, debounced) > 0) deadline = debounced;
+    struct timespec latest = schedule->last_saved;
+    latest.tv_sec += schedule->interval + schedule->debounce;
+    if (ELAPSED(latest, deadline) > 0) deadline = latest;
+    return deadline;
+}
+
+void watch_fd(EventLoop* loop, int fd, uint32_t events, int operation) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(loop->epoll_fd, operation, fd, &event)) ERR("epoll_ctl");
+}
 
-    clock_gettime(CLOCK_REALTIME, &game->last_saved);
+// Blocks SIGUSR1 and SIGUSR2 before the pathfinder workers are started,
+// so they inherit the mask and the signals only show up on signal_fd.
+void open_event_loop(EventLoop* loop, Game* game, Options* options, Frame* frame, LineReader* input) {
+    loop->game = game;
+    loop->options = options;
+    loop->frame = frame;
+    loop->input = input;
+    loop->armed_generation = 0;
+    loop->window_start = monotonic_ns();
+    loop->window_swaps = 0;
+    loop->searching = 0;
+    loop->planner = NULL;
+    loop->writer = NULL;
 
     sigset_t mask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
     sigprocmask(SIG_BLOCK, &mask, NULL);
+    if ((loop->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) ERR("signalfd");
+    if ((loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) ERR("timerfd_create");
+    if ((loop->plan_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ERR("eventfd");
+    if ((loop->save_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ERR("eventfd");
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) ERR("epoll_create1");
+    loop->pathfinders = create_pathfinder_pool(game, rng_next(&game->rng));
+
+    watch_fd(loop, loop->signal_fd, EPOLLIN, EPOLL_CTL_ADD);
+    watch_fd(loop, loop->timer_fd, EPOLLIN, EPOLL_CTL_ADD);
+    watch_fd(loop, loop->pathfinders->done_fd, EPOLLIN, EPOLL_CTL_ADD);
+    watch_fd(loop, loop->plan_fd, EPOLLIN, EPOLL_CTL_ADD);
+    watch_fd(loop, loop->save_fd, EPOLLIN, EPOLL_CTL_ADD);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = input->fd;
+    loop->input_polled = 1;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, input->fd, &event)) {
+        if (errno != EPERM) ERR("epoll_ctl");
+        loop->input_polled = 0;
+    }
+    if (game->schedule) fprintf(stderr, "[*] Autosave is enabled!\n");
+    fprintf(stderr, "[*] Signal handling is enabled!\n");
+}
 
-    pthread_mutex_t mxGameState = PTHREAD_MUTEX_INITIALIZER;
-    thread_autosave data;
-    data.path = backup_path;
-    data.game_state = game;
-    data.pmxGameState = &mxGameState;
-    pthread_create(&data.thread_id, NULL, (void *) autosave, &data);
-
-    thread_signal sig_data;
-    sig_data.game_state = game;
-    sig_data.pmxGameState = &mxGameState;
-    pthread_create(&sig_data.thread_id, NULL, (void *) sigusr1_handler, &sig_data);
-
-    while(1) {
-        scanf("%s", user);
-        pthread_mutex_lock(&mxGameState);
-        if (strcmp(user, "move-to") == 0) {
-            scanf("%s", arg);
-            int vertex_id = atoi(arg);  
-            player_move(game, vertex_id);
-        }
+// An autosave still being written is waited for, not cancelled.
+void close_event_loop(EventLoop* loop) {
+    if (loop->writer) {
+        int err = pthread_join(loop->writer->thread_id, NULL);
+        if (err != 0) ERR("pthread_join");
+        free_snapshot(loop->writer->snapshot);
+        free(loop->writer);
+    }
+    free_pathfinder_pool(loop->pathfinders);
+    close(loop->save_fd);
+    close(loop->plan_fd);
+    close(loop->epoll_fd);
+    close(loop->timer_fd);
+    close(loop->signal_fd);
+}
 
-        if (strcmp(user, "pick-up") == 0) {
-            scanf("%s", arg);
-            int item_id = atoi(arg);  
-            pickup_item(game, item_id);
-        }
+// Arms the timer for the autosave deadline, or disarms it while the game
+// is clean. Only done when the state changed since it was last armed.
+void arm_autosave_timer(EventLoop* loop) {
+    AutosaveSchedule* schedule = loop->game->schedule;
+    if (schedule == NULL || schedule->dirty_generation == loop->armed_generation) return;
+    loop->armed_generation = schedule->dirty_generation;
+
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    if (schedule->dirty_generation != schedule->saved_generation) timer.it_value = autosave_deadline(schedule);
+    if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL)) ERR("timerfd_settime");
+}
 
-        if (strcmp(user, "drop") == 0) {
-            scanf("%s", arg);
-            int item_id = atoi(arg);  
-            drop_item(game, item_id);
-        }
+void* autosave_worker(void* voidPtr) {
+    AutosaveWriter* writer = voidPtr;
+    writer->err = finish_compaction(writer->journal, writer->snapshot, writer->path);
+    struct stat saved;
+    writer->bytes = 0;
+    if (!writer->err && stat(writer->path, &saved) == 0) writer->bytes = saved.st_size;
+    uint64_t one = 1;
+    if (write(writer->done_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) ERR("write");
+    return NULL;
+}
 
-        if (strcmp(user, "save") == 0) {
-            scanf("%s", arg);  
-            int err = save_game(game, arg);
-            if (!err) printf("\n[*] Game saved to %s!\n", arg);
-            else printf("\n[!] Error while saving the game.\n");
-            clock_gettime(CLOCK_REALTIME, &game->last_saved);
+// The timer is re-armed on every change, so once it fires the deadline
+// has passed. Only the snapshot copy and the journal rotation run on the
+// loop; the file is written by an AutosaveWriter. While one is still
+// writing, the timer is ignored and armed again once it is done.
+void autosave(EventLoop* loop) {
+    uint64_t expirations;
+    if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == EAGAIN) return;
+        ERR("read");
+    }
+    Game* game = loop->game;
+    AutosaveSchedule* schedule = game->schedule;
+    if (schedule == NULL || schedule->dirty_generation == schedule->saved_generation) return;
+    if (loop->writer) return;
+
+    AutosaveWriter* writer = (AutosaveWriter*) malloc(sizeof(AutosaveWriter));
+    if (writer==NULL) ERR("malloc");
+    writer->path = loop->options->backup_path;
+    fprintf(stderr, "\n[*] Autosaving to %s ...\n", writer->path);
+    writer->start_ns = monotonic_ns();
+    writer->journal = game->journal;
+    writer->snapshot = begin_compaction(game);
+    writer->generation = schedule->dirty_generation;
+    writer->done_fd = loop->save_fd;
+    int err = pthread_create(&writer->thread_id, NULL, autosave_worker, writer);
+    if (err != 0) ERR("pthread_create");
+    loop->writer = writer;
+}
+
+// Counts a written autosave as saved, the changes made while it was
+// written stay dirty.
+void finish_autosave(EventLoop* loop) {
+    uint64_t count;
+    if (read(loop->save_fd, &count, sizeof(count)) < 0) {
+        if (errno == EAGAIN) return;
+        ERR("read");
+    }
+    AutosaveWriter* writer = loop->writer;
+    if (writer == NULL) return;
+    int err = pthread_join(writer->thread_id, NULL);
+    if (err != 0) ERR("pthread_join");
+
+    Game* game = loop->game;
+    AutosaveSchedule* schedule = game->schedule;
+    record_duration(&game->stats->autosave, monotonic_ns() - writer->start_ns);
+    __atomic_fetch_add(&game->stats->autosave_bytes, writer->bytes, __ATOMIC_RELAXED);
+    if (!writer->err) fprintf(stderr, "[*] Autosaved!\n");
+    else fprintf(stderr, "[!] Errow while autosaving\n");
+
+    schedule->saved_generation = writer->generation;
+    clock_gettime(CLOCK_MONOTONIC, &schedule->last_saved);
+    loop->armed_generation = 0;
+    free_snapshot(writer->snapshot);
+    free(writer);
+    loop->writer = NULL;
+}
+
+// Drains the signalfd, then applies all SIGUSR1 swaps read in one batch.
+void handle_signals(EventLoop* loop) {
+    Game* game = loop->game;
+    struct signalfd_siginfo infos[SIGNAL_BATCH];
+    int swaps = 0;
+    int dumps = 0;
+    ssize_t size;
+    while ((size = read(loop->signal_fd, infos, sizeof(infos))) > 0) {
+        for (int i = 0; i < size / sizeof(struct signalfd_siginfo); i++) {
+            if (infos[i].ssi_signo == SIGUSR1) swaps++;
+            else dumps++;
         }
-        pthread_mutex_unlock(&mxGameState);
-
-        if (strcmp(user, "find-path") == 0) {
-            scanf("%s", arg);
-            int threads_count = atoi(arg);
-            scanf("%s", arg);
-            int room_id = atoi(arg);
-            if (threads_count > MAX_PATHFINDING_THREADS || threads_count < 1) {
-                printf("\n[!] Please, let the computer breathe, choose number of threads <= %d\n", MAX_PATHFINDING_THREADS);
-            } else {
-                find_moderately_short_path(game, threads_count, room_id);
-            }
+    }
+    if (size < 0 && errno != EAGAIN && errno != EINTR) ERR("read");
+
+    if (swaps > 0) {
+        fprintf(stderr,"\n[*] Signal handler catched SIGUSR1!\n");
+        fprintf(stderr,"[*] Swapping %d pair%s of random items...\n", swaps, swaps == 1 ? "" : "s");
+        for (int i = 0; i < swaps; i++) swap_random_items(game);
+
+        __atomic_fetch_add(&game->stats->swaps, swaps, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&game->stats->swap_batches, 1, __ATOMIC_RELAXED);
+        uint64_t now = monotonic_ns();
+        if (now - loop->window_start >= 1000000000ULL) {
+            loop->window_start = now;
+            loop->window_swaps = 0;
         }
+        loop->window_swaps += swaps;
+        if (loop->window_swaps > game->stats->peak_swaps_per_second)
+            __atomic_store_n(&game->stats->peak_swaps_per_second, loop->window_swaps, __ATOMIC_RELAXED);
+    }
+    if (dumps > 0) {
+        print_stats(loop->frame, game->stats);
+        flush_frame(loop->frame);
+    }
+}
 
-        if (strcmp(user, "sigusr1") == 0) {
-            struct timespec t = {1, 0};
-            kill(0, SIGUSR1);
-            nanosleep(&t, NULL);
-        }
+// Records how long the command took and shows the game again. Everything
+// the command printed leaves in the same write as the game state.
+void finish_command(EventLoop* loop, char* name) {
+    Game* game = loop->game;
+    record_command_time(loop->options->script, name, &loop->command_start);
+    int command = stat_command_index(name);
+    if (command >= 0) record_duration(&game->stats->commands[command], monotonic_ns() - timespec_ns(&loop->command_start));
 
-        if (strcmp(user, "quit") == 0) {
-            pthread_cancel(data.thread_id);
-            pthread_cancel(sig_data.thread_id);
-            break;
+    if (strcmp(name, "stats") == 0) print_stats(loop->frame, game->stats);
+
+    if (loop->options->script == NULL) {
+        print_game_state(loop->frame, game, strcmp(name, "show-map") == 0);
+        show_game_menu(loop->frame);
+    }
+    flush_frame(loop->frame);
+}
+
+// The walks and the exact search run on the pathfinder workers while the
+// loop goes on with signals and autosaves, but reads no further commands.
+void start_find_path(EventLoop* loop, int walks_count, int room_id) {
+    loop->searching = 1;
+    loop->search_room = room_id;
+    if (loop->input_polled) watch_fd(loop, loop->input->fd, 0, EPOLL_CTL_MOD);
+    clock_gettime(CLOCK_MONOTONIC, &loop->search_start);
+    submit_walks(loop->pathfinders, walks_count, room_id, 1);
+}
+
+void finish_find_path(EventLoop* loop) {
+    uint64_t count;
+    if (read(loop->pathfinders->done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) ERR("read");
+    PathfinderPool* pool = loop->pathfinders;
+    if (!loop->searching || !search_finished(pool)) return;
+
+    int walk_length = collect_walks(loop->frame, pool);
+    int exact_length = collect_exact_path(loop->frame, pool);
+
+    frame_printf(loop->frame, "\nRandom walks:  ");
+    if (walk_length < 0) frame_printf(loop->frame, "no path");
+    else frame_printf(loop->frame, "%d moves", walk_length);
+    frame_printf(loop->frame, " in %.3f ms\n", (pool->walks_end_ns - timespec_ns(&loop->search_start)) / 1e6);
+    frame_printf(loop->frame, "Shortest path: %d moves in %.3f ms\n", exact_length, pool->exact_ns / 1e6);
+
+    loop->searching = 0;
+    if (loop->input_polled) watch_fd(loop, loop->input->fd, EPOLLIN, EPOLL_CTL_MOD);
+    finish_command(loop, "find-path");
+}
+
+// The solver threads run while the loop goes on with signals and
+// autosaves, but reads no further commands. The planner works on its own
+// copy of the items, so swaps made meanwhile do not change the plan.
+void start_plan_deliveries(EventLoop* loop, DeliveryPlanner* planner, uint64_t seed, int budget_ms) {
+    loop->planner = planner;
+    if (loop->input_polled) watch_fd(loop, loop->input->fd, 0, EPOLL_CTL_MOD);
+    start_plan_search(planner, seed, budget_ms, loop->plan_fd);
+    loop->plan_threads_left = planner->threads_count;
+}
+
+void finish_plan_deliveries(EventLoop* loop) {
+    uint64_t count;
+    if (read(loop->plan_fd, &count, sizeof(count)) < 0) {
+        if (errno == EAGAIN) return;
+        ERR("read");
+    }
+    if (loop->planner == NULL || (loop->plan_threads_left -= count) > 0) return;
+
+    finish_plan_search(loop->frame, loop->planner);
+    free_delivery_planner(loop->planner);
+    loop->planner = NULL;
+    if (loop->input_polled) watch_fd(loop, loop->input->fd, EPOLLIN, EPOLL_CTL_MOD);
+    finish_command(loop, "plan-deliveries");
+}
+
+// Whether a command is still running on other threads.
+int loop_busy(EventLoop* loop) {
+    return loop->searching || loop->planner != NULL;
+}
+
+// Runs one line of input. Returns 0 once the game is quit.
+int run_game_command(EventLoop* loop, char* line) {
+    Game* game = loop->game;
+    char user[MAX_INPUT_LENGTH] = "";
+    char arg[MAX_INPUT_LENGTH] = "";
+    char arg2[MAX_INPUT_LENGTH] = "";
+    if (sscanf(line, "%s %s %s", user, arg, arg2) < 1) return 1;
+    clock_gettime(CLOCK_MONOTONIC, &loop->command_start);
+
+    if (strcmp(user, "move-to") == 0) {
+        player_move(loop->frame, game, atoi(arg));
+    }
+    else if (strcmp(user, "pick-up") == 0) {
+        pickup_item(loop->frame, game, atoi(arg));
+    }
+    else if (strcmp(user, "drop") == 0) {
+        drop_item(loop->frame, game, atoi(arg));
+    }
+    else if (strcmp(user, "save") == 0) {
+        if (!save_game(game, arg)) frame_printf(loop->frame, "\n[*] Game saved to %s!\n", arg);
+        else frame_printf(loop->frame, "\n[!] Error while saving the game.\n");
+    }
+    else if (strcmp(user, "plan-deliveries") == 0) {
+        int budget_ms = atoi(arg);
+        DeliveryPlanner* planner = NULL;
+        if (budget_ms < 0) frame_printf(loop->frame, "\n[!] Error. The time budget cannot be negative.\n");
+        else planner = create_delivery_planner(loop->frame, game);
+        uint64_t plan_seed = rng_next(&game->rng);
+        if (planner) {
+            start_plan_deliveries(loop, planner, plan_seed, budget_ms);
+            return 1;
+        }
+    }
+    else if (strcmp(user, "find-path") == 0) {
+        int walks_count = atoi(arg);
+        int room_id = atoi(arg2);
+        if (walks_count < 1) {
+            frame_printf(loop->frame, "\n[!] Error. Choose at least one walk.\n");
+        } else if (room_id < 0 || room_id >= game->map->vertex_count) {
+            frame_printf(loop->frame, "\n[!] Error. Room %d does not exist.\n", room_id);
+        } else {
+            start_find_path(loop, walks_count, room_id);
+            return 1;
         }
-        
-        print_game_state(game);
-        show_game_menu();
     }
+    else if (strcmp(user, "sigusr1") == 0) {
+        kill(getpid(), SIGUSR1);
+        handle_signals(loop);
+    }
+    else if (strcmp(user, "quit") == 0) {
+        return 0;
+    }
+    finish_command(loop, user);
+    return 1;
 }
 
-int main(int argc, char** argv) {
-    show_main_menu();
+void start_game(Game* game, Options* options, LineReader* input) {
+    char* backup_path = options->backup_path;
+    char line[MAX_INPUT_LENGTH];
+    Frame frame;
+    frame.length = 0;
+    int headless = options->script != NULL;
+
+    if (!headless) {
+        print_game_state(&frame, game, 0);
+        show_game_menu(&frame);
+        flush_frame(&frame);
+    }
 
-    char* backup_path = get_backup_path(argc, argv);
+    if (game->map->vertex_count <= options->route_table_max_vertices) {
+        prepare_route_table(&frame, game);
+        flush_frame(&frame);
+    }
 
-    char user[MAX_INPUT_LENGTH];
-    char file_path[MAX_INPUT_LENGTH];
+    if (backup_path) {
+        if (start_autosave(game, backup_path)) fprintf(stderr, "[!] Error while autosaving.\n");
+        game->schedule = create_autosave_schedule(options->autosave_interval, options->autosave_debounce);
+    }
+    game->stats = (Stats*) calloc(1, sizeof(Stats));
+    if (game->stats==NULL) ERR("calloc");
+    game->stats->started_ns = monotonic_ns();
+
+    EventLoop loop;
+    open_event_loop(&loop, game, options, &frame, input);
+    int running = 1;
+    while (running) {
+        int timeout = -1;
+        if (!loop_busy(&loop) && (line_waiting(input) || input->eof || !loop.input_polled)) timeout = 0;
+        struct epoll_event events[EPOLL_EVENTS];
+        int count = epoll_wait(loop.epoll_fd, events, EPOLL_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            ERR("epoll_wait");
+        }
 
-    while(1) {
-        scanf("%s", user);
+        int input_ready = !loop.input_polled;
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == loop.signal_fd) handle_signals(&loop);
+            else if (fd == loop.timer_fd) autosave(&loop);
+            else if (fd == loop.pathfinders->done_fd) finish_find_path(&loop);
+            else if (fd == loop.plan_fd) finish_plan_deliveries(&loop);
+            else if (fd == loop.save_fd) finish_autosave(&loop);
+            else input_ready = 1;
+        }
+
+        if (!loop_busy(&loop)) {
+            if (input_ready && !line_waiting(input)) fill_line_reader(input);
+            if (next_line(input, line)) running = run_game_command(&loop, line);
+            else if (input->eof) running = run_game_command(&loop, "quit");
+        }
+        sync_journal(game->journal);
+        arm_autosave_timer(&loop);
+    }
+
+    close_event_loop(&loop);
+    if (game->journal) close_journal(game->journal);
+    game->journal = NULL;
+    free(game->schedule);
+    game->schedule = NULL;
+    if (game->routes) free_route_table(game->routes);
+    game->routes = NULL;
+    free(game->stats);
+    game->stats = NULL;
+    if (headless) {
+        options->script->checksum = game_checksum(game);
+        options->script->has_checksum = 1;
+    }
+    free_game(game);
+    record_command_time(options->script, "quit", &loop.command_start);
+}
+
+int main(int argc, char** argv) {
+    Options options = get_options(argc, argv);
+    if (options.script_path && strcmp(options.script_path, "-") != 0) {
+        int fd = open(options.script_path, O_RDONLY);
+        if (fd < 0) ERR("open");
+        if (dup2(fd, STDIN_FILENO) < 0) ERR("dup2");
+        close(fd);
+    }
+    if (!options.script) show_main_menu();
+
+    fprintf(stderr, "[*] Random seed: %llu\n", (unsigned long long) options.seed);
+    Rng rng;
+    seed_rng(&rng, options.seed);
+
+    LineReader input;
+    input.fd = STDIN_FILENO;
+    input.length = 0;
+    input.eof = 0;
+    input.discarding = 0;
+    char line[MAX_INPUT_LENGTH];
+
+    while(read_line(&input, line)) {
+        char user[MAX_INPUT_LENGTH] = "";
+        char file_path[MAX_INPUT_LENGTH] = "";
+        char arg[MAX_INPUT_LENGTH] = "";
+        if (sscanf(line, "%s %s %s", user, arg, file_path) < 1) continue;
+        struct timespec command_start;
+        clock_gettime(CLOCK_MONOTONIC, &command_start);
 
         if (strcmp(user, "read-map") == 0) {  
-            scanf("%s", file_path);
-            Graph* graph = read_graph_from_path(file_path);
-            Game* game = new_game(graph);
-            start_game(game, backup_path);
+            Graph* graph = read_graph_from_path(arg, options.max_vertex_count);
+            if (graph == NULL) {
+                printf("\n[!] Error. %s is not a map file.\n", arg);
+                continue;
+            }
+            Game* game = new_game(graph, rng_next(&rng));
+            record_command_time(options.script, user, &command_start);
+            start_game(game, &options, &input);
         }
         else if (strcmp(user, "generate-random-map") == 0) {
-            int n;
-            scanf("%d", &n);
-            scanf("%s", file_path);
+            int n = atoi(arg);
             if (n < MIN_VERTEX_COUNT) {
                 printf("\n[!] Please, at least %d vertices...\n", MIN_VERTEX_COUNT);
                 continue;
             }
-            if (n > MAX_VERTEX_COUNT) {
-                printf("\n[!] Huh, let your computer breathe, choose n <= %d please!\n", MAX_VERTEX_COUNT);
+            if (n > options.max_vertex_count) {
+                printf("\n[!] Huh, let your computer breathe, choose n <= %d please!\n", options.max_vertex_count);
                 continue;
             }
-            Graph* graph = generate_random_graph(n);
+            Graph* graph = generate_random_graph(n, &rng);
             if (save_graph_to_file(graph, file_path) == 0) {
                 printf("\n[*] Successfully saved map (%s).\n", file_path);
             }
+            free_graph(graph);
+            record_command_time(options.script, user, &command_start);
         }
         else if (strcmp(user, "map-from-dir-tree") == 0) {
-            char dir_path[MAX_INPUT_LENGTH]; 
-            scanf("%s", dir_path);
-            scanf("%s", file_path);
-            map_from_dir_tree(dir_path, file_path);  
+            map_from_dir_tree(arg, file_path, options.max_vertex_count);  
+            record_command_time(options.script, user, &command_start);
         }
         else if (strcmp(user, "load-game") == 0) {  
-            scanf("%s", file_path);
-            Game* game = load_game(file_path);
-            start_game(game, backup_path);
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            Game* game = restore_game(arg, options.max_vertex_count);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (game == NULL) {
+                printf("\n[!] Error. %s is not a saved game.\n", arg);
+                continue;
+            }
+            printf("\n[*] Game restored in %.3f s.\n", ELAPSED(start, end));
+            seed_rng(&game->rng, rng_next(&rng));
+            record_command_time(options.script, user, &command_start);
+            start_game(game, &options, &input);
         }
         else if (strcmp(user, "exit") == 0) {  
             break;
         }
+        else if (options.script) {
+            printf("\n[!] Error. Unknown command %s.\n", user);
+        }
         else {
             show_main_menu();
         }
     }
+    if (options.script) print_script_summary(options.script);
     exit(EXIT_SUCCESS); 
 }
 